@@ -22,6 +22,10 @@
 #define BOOTLOADER_JUMPER_PORT B
 #define BOOTLOADER_JUMPER_BIT  2
 
+// Microseconds for jumper's pull-up to settle before it's read, right after
+// reset. Increase if jumper has a capacitor on it.
+#define BOOTLOADER_JUMPER_SETTLE_US 50
+
 
 //**** Bootloader exit
 
@@ -35,6 +39,45 @@
 // Have bootloader auto-exit if USB isn't connected.
 #define AUTO_EXIT_NO_USB 1
 
+// Let user program enter bootloader directly with usbasploaderEnter() (see
+// usbasploader.h), rather than via watchdog reset. Bootloader then stays
+// regardless of entry condition above, and re-enumerates on USB after
+// FAST_ENTRY_DISCONNECT_MS rather than 260 ms.
+#define HAVE_FAST_ENTRY 1
+#define FAST_ENTRY_DISCONNECT_MS 50
+
+// Let user program program flash pages with usbasploaderProgramPage() (see
+// usbasploader.h). Off by default.
+#define HAVE_PAGE_SERVICE 1
+
+// Give bootloader's do_spm routine a mode that erases, fills and writes a
+// whole page per call, for programs that call it. Only on devices with pages
+// of 128 bytes or more; costs 52 bytes. Off by default.
+#define HAVE_SPM_PAGE 1
+
+// Install new bootloader written to address 0 when host sends
+// USBASP_FUNC_INSTALLLOADER with its CRC, without an updater program. Needs
+// HAVE_SELF_UPDATE.
+#define HAVE_USB_UPDATE 1
+
+// When running user program after host has enumerated bootloader, leave USB
+// attached and pass address and configuration to program at top of RAM, so
+// host doesn't have to enumerate it again (see usbasploader.h). Program must
+// use same USB descriptors as bootloader, as USBasp firmware does.
+#define HAVE_USB_HANDOFF 1
+
+// Run user program immediately after reset if USB power isn't present, rather
+// than after USB reset and AUTO_EXIT_NO_USB delays (about 0.8 seconds).
+// Set port and pin/bit that reads high when USB's VBUS is present (e.g. via
+// voltage divider).
+#define BOOTLOADER_VBUS_PORT D
+#define BOOTLOADER_VBUS_BIT  3
+
+// Same, for boards whose 1.5K D- pull-up resistor is powered from VBUS rather
+// than the device's supply, so D- only reads high when USB is connected. Not
+// with USB_CFG_PULLUP_IOPORTNAME, where the bootloader switches the pull-up.
+#define BOOTLOADER_DMINUS_SENSE 1
+
 // Have bootloader auto-exit after this many milliseconds if avrdude hasn't connected.
 #define AUTO_EXIT_MS 4000
 
@@ -58,11 +101,71 @@
 // Prevent bootloader from being able to self-update to a different version
 #define HAVE_SELF_UPDATE 0
 
+// Rewrite every page uploaded, even those whose contents are already in flash.
+// Already the default with a 2K boot section.
+#define HAVE_SKIP_UNCHANGED_PAGES 0
+
+// Allow transfers longer than 254 bytes, so a host can read/write multiple
+// pages per transfer. Off by default.
+#define HAVE_LONG_TRANSFERS 1
+
+// Accept compressed flash data (USBASP_FUNC_WRITEFLASHPACKED, see main.c).
+// Uses 256 bytes more RAM. Off by default.
+#define HAVE_PACKED_WRITE 1
+
+// Write flash as a stream of transfers that continue where previous one left
+// off (USBASP_FUNC_STREAMFLASH, see main.c). Off by default.
+#define HAVE_STREAM_WRITE 1
+
+// Check USB CRC of flash/EEPROM data packets while writing them, rather
+// than going over packet beforehand. Off by default.
+#define HAVE_WRITE_CRC 1
+
+// Compute USB CRC of flash/EEPROM being read while copying it into packet,
+// rather than going over packet again afterwards. Off by default.
+#define HAVE_READ_CRC 1
+
+// Compute CRC of flash/EEPROM range on device, for quick verification
+// (USBASP_FUNC_CRCFLASH/USBASP_FUNC_CRCEEPROM, see main.c). Off by default.
+#define HAVE_CRC 1
+
+// Erase range of flash pages without sending data for them
+// (USBASP_FUNC_ERASERANGE, see main.c). Off by default.
+#define HAVE_RANGE_ERASE 1
+
+// Time where programming session goes using Timer1, readable with
+// USBASP_FUNC_GETPROFILE. For tuning only; costs code and time.
+#define HAVE_PROFILE 1
+
+// Receive next page while previous one is being erased/written, rather than
+// making host wait for each page. Uses SPM_PAGESIZE bytes more RAM. Off by
+// default.
+#define HAVE_PIPELINED_WRITE 1
+
+// Without pipelined write, start erasing page once its first packet shows it
+// needs it, so erase overlaps receiving rest of page. Off by default.
+#define HAVE_EARLY_ERASE 1
+
+// Time auto-exit and LED blinking with Timer1, to the millisecond, rather than
+// by counting main loop iterations. Timer1 is stopped again before user
+// program runs. Off by default.
+#define HAVE_TIMER_TIMEOUTS 1
+
+// Report page programming, erase progress and errors on an interrupt-in
+// endpoint, so host tool can follow progress rather than waiting
+// conservatively (see main.c). Adds endpoint to USB descriptor. Off by
+// default.
+#define HAVE_NOTIFY 1
+
+// Use faster but larger CRC routine for packets sent. Off by default.
+#define USB_USE_FAST_CRC 1
+
 
 //**** Code size reduction
 
 // Least-important features listed first
 
+#define HAVE_FAST_EEPROM_WRITE      0 // Disable skipping unchanged eeprom bytes (default with 2K)
 #define HAVE_READ_LOCK_FUSE         0 // Disable read fuse bytes
 #define HAVE_FLASH_BYTE_READACCESS  0 // Disable read individual flash bytes
 #define HAVE_EEPROM_BYTE_ACCESS     0 // Disable read/write individual eeprom bytes
@@ -15,22 +15,86 @@
 // This also makes code less-likely to accidentally write to flash, since X being
 // anything other than SPMCR prevents it from affecting flash.
 
-static __attribute__((naked)) void do_spm( void )
-{
-	asm volatile ( // On entry, X=SPMCR, r24=command, Z=address, r1:r0=data
-	"\n	1:	st X, r24"			// Do SPM operation in r24
-	"\n		spm"
-	"\n	2:	ld r25, X"			// Wait until operation finishes
-	"\n		sbrc r25, %[spmen]"
-	"\n		rjmp 2b"
-	"\n		ldi r24, %[spmret]"	// Prepare for RWWSRE
-	"\n		sbrc r25, %[rwwsb]"	// Set RWSSRE if RWWSB is still set
+// Page mode: r24=DO_SPM_PAGE_RAM or DO_SPM_PAGE_FLASH erases page at Z, fills
+// it from Y and writes it, all in one call. Flash source must be in first 64K.
+// Also changes r20-r23 and advances Y past source. Only enabled where whole
+// routine fits in one page, since updater copies a page of it to top of flash.
+#if HAVE_SPM_PAGE && SPM_PAGESIZE >= 128
+	#define DO_SPM_PAGE_MODE 1
+#else
+	#define DO_SPM_PAGE_MODE 0
+#endif
+
+// SPMIE bit, which is never wanted for a plain SPM command, selects page mode
+#define DO_SPM_PAGE_RAM   0x80
+#define DO_SPM_PAGE_FLASH 0xC0
+
+#if DO_SPM_PAGE_MODE
+	#define DO_SPM_PAGE_ENTRY_ASM \
+	"\n		sbrc r24, 7" \
+	"\n		rjmp 10f"
+	
+	#define DO_SPM_PAGE_ASM \
+	"\n	10:	mov r23, r24"		/* Erase page */ \
+	"\n		ldi r24, %[pgers]" \
+	"\n		rcall 1b" \
+	"\n		ldi r22, %[words]" \
+	"\n	11:	sbrs r23, 6"		/* Load word from flash or RAM */ \
+	"\n		rjmp 12f" \
+	"\n		movw r20, r30" \
+	"\n		movw r30, r28" \
+	"\n		lpm r0, Z+" \
+	"\n		lpm r1, Z+" \
+	"\n		movw r28, r30" \
+	"\n		movw r30, r20" \
+	"\n		rjmp 13f" \
+	"\n	12:	ld r0, Y+" \
+	"\n		ld r1, Y+" \
+	"\n	13:	ldi r24, %[fill]"	/* Write word into page buffer */ \
+	"\n		rcall 1b" \
+	"\n		adiw r30, 2" \
+	"\n		dec r22" \
+	"\n		brne 11b" \
+	"\n		subi r30, lo8(%[pagesize])"	/* Write page */ \
+	"\n		sbci r31, hi8(%[pagesize])" \
+	"\n		ldi r24, %[pgwrt]" \
 	"\n		rjmp 1b"
+#else
+	#define DO_SPM_PAGE_ENTRY_ASM
+	#define DO_SPM_PAGE_ASM
+#endif
+
+// Body of do_spm, for asm that needs its own copy, with DO_SPM_OPERANDS.
+// Without page mode, which do_spm() adds around it.
+#define DO_SPM_ASM /* On entry, X=SPMCR, r24=command, Z=address, r1:r0=data */ \
+	"\n	1:	st X, r24"			/* Do SPM operation in r24 */ \
+	"\n		spm" \
+	"\n	2:	ld r25, X"			/* Wait until operation finishes */ \
+	"\n		sbrc r25, %[spmen]" \
+	"\n		rjmp 2b" \
+	"\n		ldi r24, %[spmret]"	/* Prepare for RWWSRE */ \
+	"\n		sbrc r25, %[rwwsb]"	/* Set RWSSRE if RWWSB is still set */ \
+	"\n		rjmp 1b" \
 	"\n		ret"
+
+#define DO_SPM_OPERANDS \
+	[spmen]    "I" (SPMEN), \
+	[rwwsb]    "I" (RWWSB), \
+	[spmret]   "M" (1<<RWWSRE | 1<<SPMEN), \
+	[pgers]    "M" (1<<PGERS | 1<<SPMEN), \
+	[pgwrt]    "M" (1<<PGWRT | 1<<SPMEN), \
+	[fill]     "M" (1<<SPMEN), \
+	[words]    "M" (SPM_PAGESIZE / 2), \
+	[pagesize] "i" (SPM_PAGESIZE)
+
+static __attribute__((naked)) void do_spm( void )
+{
+	asm volatile (
+	DO_SPM_PAGE_ENTRY_ASM
+	DO_SPM_ASM
+	DO_SPM_PAGE_ASM
 	"\n" ::
-	[spmen]  "I" (SPMEN),
-	[rwwsb]  "I" (RWWSB),
-	[spmret] "M" (1<<RWWSRE | 1<<SPMEN)
+	DO_SPM_OPERANDS
 	);
 }
 
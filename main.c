@@ -13,6 +13,7 @@
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #ifndef MCUCSR
 	#define MCUCSR MCUSR
@@ -25,6 +26,10 @@ static void leaveBootloader( void ) __attribute__((noreturn));
 #include "usbdrv/usbdrv.h"
 #include "usbdrv/oddebug.h"
 
+#if HAVE_FAST_ENTRY || HAVE_USB_HANDOFF || HAVE_PAGE_SERVICE || HAVE_USB_UPDATE
+	#include "usbasploader.h"
+#endif
+
 #define USBASP_FUNC_CONNECT         1
 #define USBASP_FUNC_DISCONNECT      2
 #define USBASP_FUNC_TRANSMIT        3
@@ -36,14 +41,25 @@ static void leaveBootloader( void ) __attribute__((noreturn));
 #define USBASP_FUNC_SETLONGADDRESS  9
 #define USBASP_FUNC_SETISPSCK      10
 
+// Extensions to USBasp protocol, not used by avrdude
+#define USBASP_FUNC_WRITEFLASHPACKED 32
+#define USBASP_FUNC_CRCFLASH         33
+#define USBASP_FUNC_CRCEEPROM        34
+#define USBASP_FUNC_ERASERANGE       35
+#define USBASP_FUNC_GETPROFILE       36
+#define USBASP_FUNC_STREAMFLASH      37
+#define USBASP_FUNC_INSTALLLOADER    38
+
 #define CLI_SEI( expr ) do { cli(); (expr); sei(); } while ( 0 )
 
 #if FLASHEND > 0xFFFF // >64KB flash
 	typedef uint32_t addr_t;
 	#define PGM_READ_BYTE pgm_read_byte_far
+	#define PGM_READ_WORD pgm_read_word_far
 #else 
 	typedef uint16_t addr_t;
 	#define PGM_READ_BYTE pgm_read_byte
+	#define PGM_READ_WORD pgm_read_word
 #endif
 
 union currentAddress_t {
@@ -60,22 +76,563 @@ union currentAddress_t {
 #endif
 
 // Effective number of clocks per iteration of main loop. Empirically timed.
-// Accounts for USB interrupts. Oddly same regardless of GLOBAL_REGS.
+// Accounts for USB interrupts. Oddly same regardless of GLOBAL_REGS. Only
+// used for timeouts without HAVE_TIMER_TIMEOUTS.
 enum { main_loop_clk = 28 };
 
 static union currentAddress_t currentAddress; // in bytes
-GLOBAL_REG( r3, uchar, bytesRemaining, 0 );
+#if HAVE_LONG_TRANSFERS
+	static usbMsgLen_t bytesRemaining; // too large for one register
+#else
+	GLOBAL_REG( r3, uchar, bytesRemaining, 0 );
+#endif
 GLOBAL_REG( r4, uchar, isLastPage, 0 ); // needs to be masked with 0x02
 #if AUTO_EXIT_NO_USB_MS
 	GLOBAL_REG( r5, uchar, currentRequest, USBASP_FUNC_DISCONNECT );
-	GLOBAL_REG( r6, uchar, timeoutHigh,
-			F_CPU/main_loop_clk / 1000 * (AUTO_EXIT_NO_USB_MS) / 0x10000 );
+	#if !HAVE_TIMER_TIMEOUTS
+		GLOBAL_REG( r6, uchar, timeoutHigh,
+				F_CPU/main_loop_clk / 1000 * (AUTO_EXIT_NO_USB_MS) / 0x10000 );
+	#endif
 #else
 	GLOBAL_REG( r5, uchar, currentRequest, 0 );
 #endif
 
+#if HAVE_TIMER_TIMEOUTS
+	// Milliseconds are counted by polling Timer1, which runs at clk/64
+	enum { timer_ms_ticks = (F_CPU + 32000) / 64000 };
+	enum { led_blink_ms   = 100 };
+	enum { exit_delay_ms  = 20 }; // lets host finish USBASP_FUNC_DISCONNECT
+	
+	static uint16_t timerLast;
+	static uchar    ledMs;
+	
+	// Counts down while currentRequest is USBASP_FUNC_DISCONNECT
+	#if AUTO_EXIT_NO_USB_MS
+		static uint16_t exitTimeout = AUTO_EXIT_NO_USB_MS;
+	#else
+		static uint16_t exitTimeout = exit_delay_ms;
+	#endif
+#endif
+
 static uchar notErased = 1;
 
+#if HAVE_SKIP_UNCHANGED_PAGES
+	// Comparison of words loaded into page buffer with what's in flash
+	enum { page_changed = 1, page_needs_erase = 2 };
+	static uchar pageChanged;
+#endif
+
+#if HAVE_EARLY_ERASE
+	static uchar pageErased; // erase of page being loaded has been started
+#endif
+
+#if HAVE_USB_UPDATE
+	static uchar installPages; // pages of new bootloader staged at address 0
+	extern volatile uchar usbTxLen;
+#endif
+
+#if HAVE_PIPELINED_WRITE
+	// Page being received, so it can be received while previous page is
+	// still being erased/written. Words are stored inverted so that cleared
+	// buffer is 0xFFFF, same as unloaded words of page buffer.
+	static uint16_t pageData [SPM_PAGESIZE / 2];
+	static addr_t pageAddr;     // somewhere within page in pageData
+	static addr_t spmAddr;      // page being erased/written
+	static uchar  pagePending;  // pageData complete, waiting for SPM to finish
+	
+	enum { spm_idle, spm_erasing, spm_writing };
+	static uchar spmState;
+#endif
+
+#if HAVE_WRITE_CRC
+	static uchar writeCrcBad; // packet of current transfer had bad CRC
+#endif
+
+#if HAVE_FAST_ENTRY
+	// Set if program jumped to bootloader via usbasploaderEnter()
+	static uchar fastEntry __attribute__((section(".noinit")));
+	
+	// Runs before RAM is initialized, and before anything is pushed on stack,
+	// which would overwrite magic word at top of RAM
+	static void checkFastEntry( void ) __attribute__((naked,used,section(".init3")));
+	static void checkFastEntry( void )
+	{
+		volatile uint16_t* magic = (volatile uint16_t*) (RAMEND - 1);
+		fastEntry = (*magic == USBASPLOADER_MAGIC);
+		*magic = 0; // so it isn't seen again after a reset
+	}
+	
+	#define FAST_ENTRY() fastEntry
+#else
+	#define FAST_ENTRY() 0
+#endif
+
+// **** Profiling
+
+#if HAVE_PROFILE
+	// Timer1 ticks (64 clocks each) spent in each place, inclusive of
+	// anything nested, including USB interrupts. USB interrupt handler can't
+	// be timed itself since it mustn't be delayed, so its share is only
+	// visible as what's left of prof_total.
+	enum { prof_total, prof_poll, prof_write, prof_read, prof_spm_wait,
+			prof_eeprom_wait, prof_count };
+	
+	static struct {
+		uint32_t ticks [prof_count];
+		uint16_t transfers;
+		uint16_t pages;
+	} prof;
+	
+	// Timer1 extended to 32 bits. Timer wraps every 65536 ticks (262 ms at
+	// 16 MHz), so this must be called more often than that, including
+	// within requests that loop for longer (see PROF_POLL()).
+	static uint32_t profNow( void )
+	{
+		static uint32_t now;
+		uint16_t t = TCNT1;
+		now += (uint16_t) (t - (uint16_t) now);
+		return now;
+	}
+	
+	#define PROF_BEGIN()  uint32_t profStart = profNow()
+	#define PROF_END( n ) (prof.ticks [n] += profNow() - profStart)
+	#define PROF_POLL()   profNow()
+	
+	// Times expression
+	#define PROF( n, expr ) do { PROF_BEGIN(); expr; PROF_END( n ); } while ( 0 )
+	
+	// Called every main loop iteration
+	static void profTotal( void )
+	{
+		static uint32_t last;
+		uint32_t t = profNow();
+		prof.ticks [prof_total] += t - last;
+		last = t;
+	}
+#else
+	#define PROF_BEGIN()
+	#define PROF_END( n )
+	#define PROF_POLL()
+	#define PROF( n, expr ) expr
+#endif
+
+// **** Notifications
+
+#if HAVE_NOTIFY
+	// Sent on interrupt-in endpoint 1 whenever something has happened since
+	// previous report, so host can follow progress without control transfers.
+	// Events accumulate until endpoint is free, and counters wrap around.
+	enum { notify_page = 0x01, notify_erase = 0x02, notify_crc_error = 0x04,
+			notify_refused = 0x08 };
+	
+	static struct {
+		uchar    events; // notify_* bits since previous report
+		uchar    pages;  // pages programmed (or left alone if unchanged)
+		uchar    erases; // pages erased by chip or range erase
+		uchar    unused;
+		uint32_t addr;   // address of most recent event
+	} notify;
+	
+	static void notifyEvent( uchar event, addr_t addr )
+	{
+		if ( event & notify_page )
+			notify.pages++;
+		if ( event & notify_erase )
+			notify.erases++;
+		notify.events |= event;
+		notify.addr = addr;
+	}
+	
+	// Called from main loop
+	static void pollNotify( void )
+	{
+		if ( notify.events && usbInterruptIsReady() )
+		{
+			usbSetInterrupt( (uchar*) &notify, sizeof notify );
+			notify.events = 0;
+		}
+	}
+#else
+	#define notifyEvent( event, addr )
+#endif
+
+// **** Page programming
+
+#if HAVE_SKIP_UNCHANGED_PAGES
+	// Notes how word about to be loaded into page buffer differs from flash
+	static void compareWord( addr_t addr, uint16_t word )
+	{
+		uint16_t old = PGM_READ_WORD( addr );
+		if ( old != word )
+			pageChanged |= page_changed;
+		
+		// programming can only clear bits
+		if ( (old & word) != word )
+			pageChanged |= page_needs_erase;
+	}
+#endif
+
+// True if page must be erased before writing
+static uchar pageNeedsErase( void )
+{
+	uchar erase = 0;
+	#if !HAVE_CHIP_ERASE
+		erase = !notErased;
+	#endif
+	#if HAVE_SKIP_UNCHANGED_PAGES
+		// even if host didn't erase chip (avrdude -D)
+		if ( pageChanged & page_needs_erase )
+			erase = 1;
+	#endif
+	#if HAVE_EARLY_ERASE
+		if ( pageErased )
+			erase = 0; // already done
+	#endif
+	return erase;
+}
+
+#if HAVE_PIPELINED_WRITE
+	// Loads pageData into page buffer and starts erasing/writing it. SPM must
+	// be idle.
+	static void commitPage( void )
+	{
+		addr_t addr = pageAddr & ~(addr_t) (SPM_PAGESIZE - 1);
+		spmAddr = addr;
+		
+		uint16_t* p = pageData;
+		do
+		{
+			uint16_t word = ~*p;
+			*p++ = 0;
+			#if HAVE_SKIP_UNCHANGED_PAGES
+				compareWord( addr, word );
+			#endif
+			CLI_SEI( boot_page_fill( addr, word ) );
+			addr += 2;
+		}
+		while ( addr & (SPM_PAGESIZE - 1) );
+		
+		uchar state = spm_idle;
+		#if HAVE_SKIP_UNCHANGED_PAGES
+			// Leave page alone if it already has this data
+			if ( pageChanged )
+		#endif
+		{
+			state = spm_writing;
+			if ( pageNeedsErase() )
+				state = spm_erasing;
+		}
+		#if HAVE_SKIP_UNCHANGED_PAGES
+			pageChanged = 0;
+		#endif
+		
+		spmState = state;
+		if ( state == spm_erasing )
+			CLI_SEI( boot_page_erase( spmAddr ) );
+		else if ( state == spm_writing )
+			CLI_SEI( boot_page_write( spmAddr ) );
+		else
+		{
+			CLI_SEI( boot_rww_enable() ); // clears page buffer
+			notifyEvent( notify_page, spmAddr );
+		}
+	}
+	
+	// Starts next step of page programming once current one is done. Called
+	// from main loop.
+	static void pollPage( void )
+	{
+		if ( spmState && !boot_spm_busy() )
+		{
+			if ( spmState == spm_erasing )
+			{
+				CLI_SEI( boot_page_write( spmAddr ) );
+				spmState = spm_writing;
+			}
+			else
+			{
+				CLI_SEI( boot_rww_enable() );
+				spmState = spm_idle;
+				notifyEvent( notify_page, spmAddr );
+				
+				if ( pagePending )
+				{
+					pagePending = 0;
+					commitPage();
+					usbEnableAllRequests();
+				}
+			}
+		}
+	}
+	
+	// Waits for page programming to finish, so flash can be read and EEPROM
+	// written
+	static void finishPage( void )
+	{
+		PROF_BEGIN();
+		while ( spmState )
+			pollPage();
+		PROF_END( prof_spm_wait );
+	}
+#endif
+
+// Loads word into page at currentAddress and advances to next word
+static void fillWord( uint16_t word )
+{
+	#if HAVE_PIPELINED_WRITE
+		pageData [(currentAddress.w [0] & (SPM_PAGESIZE - 1)) / 2] = ~word;
+	#else
+		#if HAVE_EARLY_ERASE
+			// Page can't be read once its erase has started, and fill must
+			// wait for erase to finish
+			if ( pageErased )
+				PROF( prof_spm_wait, boot_spm_busy_wait() );
+			#if HAVE_SKIP_UNCHANGED_PAGES
+			else
+				compareWord( currentAddress.a, word );
+			#endif
+		#elif HAVE_SKIP_UNCHANGED_PAGES
+			compareWord( currentAddress.a, word );
+		#endif
+		CLI_SEI( boot_page_fill( currentAddress.a, word ) );
+	#endif
+	currentAddress.a += 2;
+}
+
+#if HAVE_EARLY_ERASE
+	// Starts erasing partially loaded page as soon as it's known to need it,
+	// so that erase runs while host sends rest of page. Page buffer is
+	// unaffected by erase. Called after each packet.
+	static void earlyErase( void )
+	{
+		if ( !(currentAddress.w [0] & (SPM_PAGESIZE - 1)) )
+			return; // no words of page loaded yet
+		
+		#if HAVE_SKIP_UNCHANGED_PAGES
+			if ( !pageChanged )
+				return; // might be left alone
+		#endif
+		
+		if ( pageNeedsErase() )
+		{
+			CLI_SEI( boot_page_erase( currentAddress.a ) );
+			pageErased = 1;
+		}
+	}
+	
+	// Waits for early erase and makes RWW section readable again, when a
+	// write ends mid-page without its last-page flag. Enabling RWW clears
+	// page buffer, so what was loaded of the page is lost, as the erase
+	// already lost what the page held.
+	static void finishPage( void )
+	{
+		if ( pageErased )
+		{
+			PROF( prof_spm_wait, boot_spm_busy_wait() );
+			CLI_SEI( boot_rww_enable() );
+			pageErased = 0;
+		}
+	}
+#endif
+
+// Writes page that fillWord() just loaded last word of. More is true if
+// caller has more words to load right away.
+static void endPage( uchar more )
+{
+	#if HAVE_PROFILE
+		prof.pages++;
+	#endif
+	
+	#if HAVE_PIPELINED_WRITE
+		pageAddr = currentAddress.a - 2;
+		if ( spmState && !more )
+		{
+			// NAK host until previous page is done and this one
+			// has been loaded into page buffer
+			pagePending = 1;
+			usbDisableAllRequests();
+		}
+		else
+		{
+			finishPage(); // only waits if more data for next page
+			commitPage();
+		}
+	#else
+		#if HAVE_SKIP_UNCHANGED_PAGES
+			// Partial page must still be written, since erase would
+			// clear rest of it
+			if ( currentAddress.w [0] & (SPM_PAGESIZE - 1) )
+				pageChanged |= page_changed;
+			
+			// Leave page alone if it already has this data
+			if ( pageChanged )
+		#endif
+		{
+			if ( pageNeedsErase() )
+			{
+				CLI_SEI( boot_page_erase( currentAddress.a - 2 ) );
+				PROF( prof_spm_wait, boot_spm_busy_wait() );
+			}
+			
+			CLI_SEI( boot_page_write( currentAddress.a - 2 ) );
+			PROF( prof_spm_wait, boot_spm_busy_wait() );
+		}
+		#if HAVE_SKIP_UNCHANGED_PAGES
+			pageChanged = 0;
+		#endif
+		#if HAVE_EARLY_ERASE
+			pageErased = 0;
+		#endif
+		
+		// also clears page buffer if page wasn't written
+		CLI_SEI( boot_rww_enable() );
+		notifyEvent( notify_page, (currentAddress.a - 2) & ~(addr_t) (SPM_PAGESIZE - 1) );
+	#endif
+}
+
+#if HAVE_CHIP_ERASE || HAVE_RANGE_ERASE
+	// Erases page at addr, unless it's already blank
+	static void erasePage( addr_t addr )
+	{
+		PROF_POLL(); // chip and range erase can take seconds
+		
+		addr_t a = addr;
+		do
+		{
+			if ( PGM_READ_WORD( a ) != 0xFFFF )
+			{
+				CLI_SEI( boot_page_erase( addr ) );
+				PROF( prof_spm_wait, boot_spm_busy_wait() );
+				CLI_SEI( boot_rww_enable() ); // so following pages can be read
+				break;
+			}
+			a += 2;
+		}
+		while ( a & (SPM_PAGESIZE - 1) );
+		
+		notifyEvent( notify_erase, addr );
+	}
+#endif
+
+// **** Packed flash upload
+
+#if HAVE_PACKED_WRITE
+	// Data is a stream of tokens:
+	//     0nnnnnnn data...   n+1 literal bytes follow
+	//     10vnnnnn           n+1 bytes of 0x00 (v=0) or 0xFF (v=1)
+	//     11nnnnnn offset    n+3 bytes repeated from offset+1 bytes back
+	// Tokens can be split between transfers. First transfer of stream has
+	// 0x01 set in high byte of wIndex, and gives flash address in wValue.
+	// Last has 0x02 set, and any partial page left is then written.
+	
+	static uchar packWindow [256]; // most recent output, for repeats
+	static uchar packPos;
+	static uchar packLiteral;      // literal bytes remaining
+	static uchar packRepeat;       // repeat length, waiting for offset byte
+	static uchar packOdd;          // packLow has first byte of word
+	static uchar packLow;
+	
+	static void unpackOutput( uchar b )
+	{
+		packWindow [packPos++] = b;
+		
+		packOdd ^= 1;
+		if ( packOdd )
+		{
+			packLow = b;
+		}
+		else if ( currentAddress.a < (addr_t) BOOTLOADER_ADDRESS )
+		{
+			fillWord( packLow | b << 8 );
+			if ( (currentAddress.w [0] & (SPM_PAGESIZE - 1)) == 0 )
+				endPage( 1 );
+		}
+	}
+	
+	static void unpackByte( uchar b )
+	{
+		if ( packLiteral )
+		{
+			packLiteral--;
+			unpackOutput( b );
+		}
+		else if ( packRepeat )
+		{
+			uchar from = packPos - b - 1;
+			do
+			{
+				unpackOutput( packWindow [from++] );
+			}
+			while ( --packRepeat );
+		}
+		else if ( !(b & 0x80) )
+		{
+			packLiteral = b + 1;
+		}
+		else if ( !(b & 0x40) )
+		{
+			uchar fill = (b & 0x20) ? 0xFF : 0x00;
+			b = (b & 0x1F) + 1;
+			do
+			{
+				unpackOutput( fill );
+			}
+			while ( --b );
+		}
+		else
+		{
+			packRepeat = (b & 0x3F) + 3;
+		}
+	}
+	
+	// Writes partial page at end of stream
+	static void unpackEnd( void )
+	{
+		if ( packOdd )
+			unpackOutput( 0xFF );
+		
+		if ( currentAddress.w [0] & (SPM_PAGESIZE - 1) )
+			endPage( 0 );
+	}
+#endif
+
+// **** EEPROM
+
+#if HAVE_FAST_EEPROM_WRITE
+	// Writes byte only if it differs, and only erases or only writes if
+	// that's enough to get the new value
+	static void eepromWrite( uint16_t addr, uchar value )
+	{
+		#if HAVE_PROFILE
+			PROF( prof_eeprom_wait, eeprom_busy_wait() );
+		#endif
+		uchar old = eeprom_read_byte( (void*) addr ); // also sets EEAR
+		if ( old != value )
+		{
+		#ifdef EEPM0
+			uchar mode = 0; // erase then write
+			if ( value == 0xFF )
+				mode = 1<<EEPM0; // erase only
+			else if ( (old & value) == value )
+				mode = 1<<EEPM1; // write only, since it can only clear bits
+			
+			EEDR = value;
+			EECR = mode;
+			CLI_SEI( (EECR |= 1<<EEMPE, EECR |= 1<<EEPE) );
+		#else
+			eeprom_write_byte( (void*) addr, value );
+		#endif
+		}
+	}
+#elif HAVE_PROFILE
+	#define eepromWrite( addr, value ) do {\
+		PROF( prof_eeprom_wait, eeprom_busy_wait() );\
+		eeprom_write_byte( (void*) (addr), value );\
+	} while ( 0 )
+#else
+	#define eepromWrite( addr, value ) eeprom_write_byte( (void*) (addr), value )
+#endif
+
 // **** Commands
 
 static uchar usbFunctionSetup_USBASP_FUNC_TRANSMIT( const usbRequest_t* rq )
@@ -124,7 +681,7 @@ static uchar usbFunctionSetup_USBASP_FUNC_TRANSMIT( const usbRequest_t* rq )
 	}
 	else if ( RQ_BYTE == 0xC0 )
 	{
-		eeprom_write_byte( (void*) u.word, rq->wIndex.bytes [1] );
+		eepromWrite( u.word, rq->wIndex.bytes [1] );
 	}
 #endif
 
@@ -135,10 +692,7 @@ static uchar usbFunctionSetup_USBASP_FUNC_TRANSMIT( const usbRequest_t* rq )
 		#else
 			addr_t addr;
 			for ( addr = 0; addr < (addr_t) BOOTLOADER_ADDRESS; addr += SPM_PAGESIZE ) 
-			{
-				CLI_SEI( boot_page_erase( addr ) );
-				boot_spm_busy_wait();
-			}
+				erasePage( addr );
 		#endif
 	}
 	else // ignore other commands
@@ -149,19 +703,39 @@ static uchar usbFunctionSetup_USBASP_FUNC_TRANSMIT( const usbRequest_t* rq )
 }
 
 
-uchar usbFunctionSetup( uchar data [8] )
+usbMsgLen_t usbFunctionSetup( uchar data [8] )
 {
 	const usbRequest_t* rq = (const usbRequest_t*) data;
 	
-	#if AUTO_EXIT_NO_USB_MS
+	#if HAVE_TIMER_TIMEOUTS
+		exitTimeout = exit_delay_ms;
+	#elif AUTO_EXIT_NO_USB_MS
 		timeoutHigh = 2; // 1 could expire immediately
 	#endif
 	
+	#if HAVE_PIPELINED_WRITE || HAVE_EARLY_ERASE
+		// Only more flash data can be handled while a page is being written
+		// or erased
+		if ( rq->bRequest != USBASP_FUNC_WRITEFLASH &&
+				rq->bRequest != USBASP_FUNC_WRITEFLASHPACKED &&
+				rq->bRequest != USBASP_FUNC_STREAMFLASH &&
+				rq->bRequest != USBASP_FUNC_SETLONGADDRESS )
+			finishPage();
+	#endif
+	
 	static uchar replyBuffer [4];
 	usbMsgPtr = (usbMsgPtr_t) replyBuffer;
 	
 	currentRequest = rq->bRequest;
 	
+	#if HAVE_PROFILE
+		prof.transfers++;
+	#endif
+	
+	#if HAVE_WRITE_CRC
+		writeCrcBad = 0;
+	#endif
+	
 	if ( rq->bRequest == USBASP_FUNC_TRANSMIT )
 	{
 		replyBuffer [3] = usbFunctionSetup_USBASP_FUNC_TRANSMIT( rq );
@@ -187,11 +761,155 @@ uchar usbFunctionSetup( uchar data [8] )
 		}
 		else // USBASP_FUNC_(READ/WRITE)FLASH, USBASP_FUNC_(READ/WRITE)EEPROM
 		{
-			bytesRemaining = rq->wLength.bytes [0];
+			#if HAVE_LONG_TRANSFERS
+				bytesRemaining = rq->wLength.word;
+			#else
+				bytesRemaining = rq->wLength.bytes [0];
+			#endif
 			isLastPage = rq->wIndex.bytes [1];
 			return USB_NO_MSG; // causes callbacks to read/write functions below
 		}
 	}
+#if HAVE_PACKED_WRITE
+	else if ( rq->bRequest == USBASP_FUNC_WRITEFLASHPACKED )
+	{
+		isLastPage = rq->wIndex.bytes [1];
+		if ( isLastPage & 0x01 )
+		{
+			currentAddress.w [0] = rq->wValue.word;
+			packLiteral = 0;
+			packRepeat  = 0;
+			packOdd     = 0;
+		}
+		#if HAVE_LONG_TRANSFERS
+			bytesRemaining = rq->wLength.word;
+		#else
+			bytesRemaining = rq->wLength.bytes [0];
+		#endif
+		return USB_NO_MSG;
+	}
+#endif
+#if HAVE_STREAM_WRITE
+	else if ( rq->bRequest == USBASP_FUNC_STREAMFLASH )
+	{
+		// Writes flash where previous transfer left off. First transfer has
+		// 0x01 in high byte of wIndex and gives 24-bit address in wValue and
+		// low byte of wIndex. Last has 0x02, as for USBASP_FUNC_WRITEFLASH.
+		isLastPage = rq->wIndex.bytes [1];
+		if ( isLastPage & 0x01 )
+		{
+			currentAddress.w [0] = rq->wValue.word;
+			#if FLASHEND > 0xFFFF
+				currentAddress.w [1] = rq->wIndex.bytes [0];
+			#endif
+		}
+		currentRequest = USBASP_FUNC_WRITEFLASH; // handled same from here on
+		#if HAVE_LONG_TRANSFERS
+			bytesRemaining = rq->wLength.word;
+		#else
+			bytesRemaining = rq->wLength.bytes [0];
+		#endif
+		return USB_NO_MSG;
+	}
+#endif
+#if HAVE_CRC
+	else if ( rq->bRequest == USBASP_FUNC_CRCFLASH ||
+			rq->bRequest == USBASP_FUNC_CRCEEPROM )
+	{
+		// CRC-16/MODBUS of wIndex bytes (0 = 65536) starting at wValue
+		currentAddress.w [0] = rq->wValue.word;
+		addr_t a = currentAddress.a;
+		uint16_t n = rq->wIndex.word;
+		uint16_t crc = 0xFFFF;
+		do
+		{
+			uchar b;
+			if ( rq->bRequest == USBASP_FUNC_CRCEEPROM )
+				b = eeprom_read_byte( (void*) (uint16_t) a );
+			else
+				b = PGM_READ_BYTE( a );
+			crc = _crc16_update( crc, b );
+			a++;
+			if ( !(uchar) n )
+				PROF_POLL(); // 64K takes longer than timer wraps
+		}
+		while ( --n );
+		currentAddress.a = a;
+		
+		replyBuffer [0] = crc;
+		replyBuffer [1] = crc >> 8;
+		return 2;
+	}
+#endif
+#if HAVE_RANGE_ERASE
+	else if ( rq->bRequest == USBASP_FUNC_ERASERANGE )
+	{
+		// Erases pages from wValue up to wIndex, nothing if range is empty.
+		// Upper word of both is from USBASP_FUNC_SETLONGADDRESS.
+		if ( rq->wIndex.word <= rq->wValue.word )
+			return 0;
+		uint16_t start = rq->wValue.word & ~(SPM_PAGESIZE - 1);
+		uint16_t n = (rq->wIndex.word - start + (SPM_PAGESIZE - 1)) & ~(SPM_PAGESIZE - 1);
+		currentAddress.w [0] = start;
+		do
+		{
+			if ( currentAddress.a >= (addr_t) BOOTLOADER_ADDRESS )
+				break;
+			erasePage( currentAddress.a );
+			currentAddress.a += SPM_PAGESIZE;
+		}
+		while ( n -= SPM_PAGESIZE );
+	}
+#endif
+#if HAVE_USB_UPDATE
+	else if ( rq->bRequest == USBASP_FUNC_INSTALLLOADER )
+	{
+		// New bootloader image of wIndex bytes has already been written at
+		// address 0, and wValue is its CRC-16/MODBUS. A stray request or
+		// bad image is refused with a STALL before anything is rewritten.
+		// Top page must be left for installer's copy of do_spm. Installed
+		// once status stage has been sent.
+		uint16_t size = rq->wIndex.word;
+		if ( size && size <= BOOTLOADER_SIZE - SPM_PAGESIZE )
+		{
+			addr_t a = 0;
+			uint16_t crc = 0xFFFF;
+			do
+			{
+				crc = _crc16_update( crc, PGM_READ_BYTE( a ) );
+				a++;
+				if ( !(uchar) a )
+					PROF_POLL();
+			}
+			while ( a < size );
+			
+			if ( crc == rq->wValue.word )
+			{
+				installPages = (size + (SPM_PAGESIZE - 1)) / SPM_PAGESIZE;
+				return 0;
+			}
+		}
+		usbTxLen = USBPID_STALL;
+		return USB_NO_MSG; // otherwise driver replaces STALL with status
+	}
+#endif
+#if HAVE_PROFILE
+	else if ( rq->bRequest == USBASP_FUNC_GETPROFILE )
+	{
+		// Clears counters if wValue is non-zero, otherwise returns them
+		if ( rq->wValue.bytes [0] )
+		{
+			uchar* p = (uchar*) &prof;
+			uchar n = sizeof prof;
+			do
+				*p++ = 0;
+			while ( --n );
+			return 0;
+		}
+		usbMsgPtr = (usbMsgPtr_t) &prof;
+		return sizeof prof;
+	}
+#endif
 	else // ignored: USBASP_FUNC_CONNECT, USBASP_FUNC_DISCONNECT
 	{
 	}
@@ -202,59 +920,118 @@ uchar usbFunctionSetup( uchar data [8] )
 
 // **** Data read/write
 
-uchar usbFunctionWrite( uchar* data, uchar len )
+#if HAVE_WRITE_CRC
+	// Finishes CRC of packet begun by writeData() and returns result, or
+	// 0xFF to stall transfer if any packet's CRC was bad. Data has already
+	// been used by then, but host at least finds out. Has to keep returning
+	// 0xFF through last packet, since usbdrv replaces the STALL with a
+	// status packet once that's received.
+	static uchar endWriteCrc( uint16_t crc, const uchar* data, const uchar* end,
+			uchar result )
+	{
+		while ( data != end )
+			crc = _crc16_update( crc, *data++ );
+		
+		if ( crc != 0xB001 ) // remainder when CRC matches
+		{
+			writeCrcBad = 1;
+			notifyEvent( notify_crc_error, currentAddress.a );
+		}
+		
+		if ( writeCrcBad )
+			return 0xFF;
+		
+		return result;
+	}
+	
+	#define WRITE_CRC( b )      (crc = _crc16_update( crc, b ))
+	#define WRITE_RESULT( r )   endWriteCrc( crc, data, crcEnd, r )
+#else
+	#define WRITE_CRC( b )
+	#define WRITE_RESULT( r )   (r)
+#endif
+
+static uchar writeData( uchar* data, uchar len )
 {
+	#if HAVE_WRITE_CRC
+		// USB_RX_USER_HOOK leaves CRC check of data packets to us, so it's
+		// done along with using data rather than in a pass of its own
+		const uchar* crcEnd = data + len + 2;
+		uint16_t crc = 0xFFFF;
+	#endif
+	
 	if ( len > bytesRemaining )
 		len = bytesRemaining;
 	bytesRemaining -= len;
 	uchar isLast = (bytesRemaining == 0);
 	
+	#if HAVE_PACKED_WRITE
+		if ( currentRequest == USBASP_FUNC_WRITEFLASHPACKED )
+		{
+			while ( len-- )
+			{
+				WRITE_CRC( *data );
+				unpackByte( *data++ );
+			}
+			
+			if ( isLast && isLastPage & 0x02 )
+				unpackEnd();
+			
+			#if HAVE_EARLY_ERASE
+				earlyErase();
+			#endif
+			
+			return WRITE_RESULT( isLast );
+		}
+	#endif
+	
 	for ( len++; len > 1; )
 	{
 	#if HAVE_EEPROM_PAGED_ACCESS
 		if ( currentRequest >= USBASP_FUNC_READEEPROM )
 		{
-			eeprom_write_byte( (void*) (currentAddress.w [0]++), *data++ );
+			WRITE_CRC( *data );
+			eepromWrite( currentAddress.w [0]++, *data++ );
 			len--;
 		}
 		else
 	#endif
 		if ( currentAddress.a >= (addr_t) BOOTLOADER_ADDRESS )
 		{
+			notifyEvent( notify_refused, currentAddress.a );
 			return 1;
 		}
 		else
 		{
-			CLI_SEI( boot_page_fill( currentAddress.a, *(uint16_t*) data ) );
-			
+			WRITE_CRC( data [0] );
+			WRITE_CRC( data [1] );
+			fillWord( *(uint16_t*) data );
 			data += 2;
 			len  -= 2;
-			currentAddress.a += 2;
 			
 			// write page after last word has been written for that page, either
 			// because it was last word of page, or last one host will be writing
 			if ( (currentAddress.w [0] & (SPM_PAGESIZE - 1)) == 0 ||
 					(isLast && len <= 1 && isLastPage & 0x02) )
-			{
-				#if !HAVE_CHIP_ERASE
-					if ( !notErased )
-					{
-						CLI_SEI( boot_page_erase( currentAddress.a - 2 ) );
-						boot_spm_busy_wait();
-					}
-				#endif
-				
-				CLI_SEI( boot_page_write( currentAddress.a - 2 ) );
-				boot_spm_busy_wait();
-				CLI_SEI( boot_rww_enable() );
-			}
-			
+				endPage( len > 1 );
 		}
 	}
-	return isLast;
+	
+	#if HAVE_EARLY_ERASE
+		if ( currentRequest < USBASP_FUNC_READEEPROM )
+			earlyErase();
+	#endif
+	
+	return WRITE_RESULT( isLast );
 }
 
-uchar usbFunctionRead( uchar* data, uchar len )
+#if HAVE_READ_CRC
+	// USB CRC of data readData() just returned, for txCrcAppend()
+	static uint16_t txCrc;
+	static uchar    txCrcReady;
+#endif
+
+static uchar readData( uchar* data, uchar len )
 {
 #if HAVE_FLASH_PAGED_READ || HAVE_EEPROM_PAGED_ACCESS
 	if ( len > bytesRemaining )
@@ -262,22 +1039,48 @@ uchar usbFunctionRead( uchar* data, uchar len )
 	bytesRemaining -= len;
 	
 	addr_t a = currentAddress.a; // optimization
+	#if HAVE_READ_CRC
+		uint16_t crc = 0xFFFF;
+	#endif
 	uchar n;
 	for ( n = len; n; n-- )
 	{
-		// optimization: read unconditionally, since extra pgm read is harmless
-		uchar b = PGM_READ_BYTE( a );
-		#if HAVE_EEPROM_PAGED_ACCESS
-			#if HAVE_FLASH_PAGED_READ
+		#if HAVE_READ_CRC
+			// Only read memory request is for, since this is a speed feature
+			uchar b;
+			#if HAVE_FLASH_PAGED_READ && HAVE_EEPROM_PAGED_ACCESS
 				if ( currentRequest >= USBASP_FUNC_READEEPROM )
-			#endif
 					b = eeprom_read_byte( (void*) (uint16_t) a );
+				else
+					b = PGM_READ_BYTE( a );
+			#elif HAVE_EEPROM_PAGED_ACCESS
+				b = eeprom_read_byte( (void*) (uint16_t) a );
+			#else
+				b = PGM_READ_BYTE( a );
+			#endif
+		#else
+			// optimization: read unconditionally, since extra pgm read is harmless
+			uchar b = PGM_READ_BYTE( a );
+			#if HAVE_EEPROM_PAGED_ACCESS
+				#if HAVE_FLASH_PAGED_READ
+					if ( currentRequest >= USBASP_FUNC_READEEPROM )
+				#endif
+						b = eeprom_read_byte( (void*) (uint16_t) a );
+			#endif
 		#endif
 		*data++ = b;
 		a++;
+		#if HAVE_READ_CRC
+			crc = _crc16_update( crc, b );
+		#endif
 	}
 	currentAddress.a = a;
 	
+	#if HAVE_READ_CRC
+		txCrc = ~crc;
+		txCrcReady = 1;
+	#endif
+	
 	return len;
 #else
 	return 0;
@@ -285,6 +1088,22 @@ uchar usbFunctionRead( uchar* data, uchar len )
 }
 
 
+// Called once each, so inlined
+uchar usbFunctionWrite( uchar* data, uchar len )
+{
+	uchar result;
+	PROF( prof_write, result = writeData( data, len ) );
+	return result;
+}
+
+uchar usbFunctionRead( uchar* data, uchar len )
+{
+	uchar result;
+	PROF( prof_read, result = readData( data, len ) );
+	return result;
+}
+
+
 // **** Self-update
 
 #if !defined (HAVE_SELF_UPDATE) || HAVE_SELF_UPDATE
@@ -301,21 +1120,315 @@ uchar usbFunctionRead( uchar* data, uchar len )
 #endif
 
 
+// **** Bootloader install over USB
+
+#if HAVE_USB_UPDATE
+	#pragma push_macro("_VECTOR")
+	#undef  _VECTOR
+	#define _VECTOR(n) n
+	enum { spm_rdy_vect_num = SPM_RDY_vect };
+	#pragma pop_macro("_VECTOR")
+	
+	#define INSTALL_TOP_PAGE ((uint32_t) FLASHEND - SPM_PAGESIZE + 1)
+	
+	enum { installer_size  = 192 }; // upper bound, checked by assembler
+	enum { installer_pages = (installer_size + SPM_PAGESIZE - 1) / SPM_PAGESIZE };
+	enum { installer_tail  = 20 };  // offset after RJMP and DO_SPM_ASM, checked
+	
+	extern const uchar installerCode [] PROGMEM;
+	
+	// Copied into application flash just after staged image and run from
+	// there, since it rewrites the bootloader, so it must be position
+	// independent. As update.c, it first copies do_spm to top of flash, then
+	// uses that to write the image, which never reaches the top page. Then
+	// jumps to the tail in that copy, which erases image and installer so
+	// neither is left to be run as the program. Entered with r16=pages of
+	// image and r15:r14=its own address; ends waiting for watchdog reset.
+	static void __attribute__((naked,used)) installer( void )
+	{
+		asm volatile (
+		"\n	.global installerCode"
+		"\n	installerCode:"
+		"\n		rjmp 3f"
+		DO_SPM_ASM					// do_spm2 once copied to top of flash
+		
+		// Erases r16 pages from Z and waits. Only run from copy at top of
+		// flash, since it erases what called it.
+		"\n	20:"
+		"\n	.if 20b - installerCode != %[tailoff]"
+		"\n		.error \"installer tail moved\""
+		"\n	.endif"
+		"\n		wdr"
+		"\n		ldi r24, %[pgers]"
+		"\n		rcall 1b"
+		"\n		subi r30, lo8(-(%[pagesize]))"
+		"\n		sbci r31, hi8(-(%[pagesize]))"
+		"\n		dec r16"
+		"\n		brne 20b"
+		"\n		rjmp ."				// watchdog resets into new bootloader
+		
+		"\n	3:	ldi r26, lo8(%[spmcr])"	// X=spmcr
+		"\n		ldi r27, hi8(%[spmcr])"
+		#ifdef RAMPZ
+		"\n		ldi r24, %[bank]"	// bootloader is all in one 64K bank
+		"\n		sts %[rampz], r24"
+		#endif
+		"\n		clr r17"			// old bootloader's do_spm1
+		"\n		ldi r24, %[spmret]"	// clear page buffer
+		"\n		rcall 7f"
+		"\n		movw r28, r14"		// Y=this code
+		"\n		ldi r30, lo8(%[top])"
+		"\n		ldi r31, hi8(%[top])"
+		"\n		rcall 6f"
+		
+		"\n		ldi r17, 1"			// do_spm2 for the rest
+		"\n		mov r19, r16"
+		"\n		clr r28"			// Y=image
+		"\n		clr r29"
+		"\n		ldi r30, lo8(%[boot])"
+		"\n		ldi r31, hi8(%[boot])"
+		"\n	4:	rcall 6f"
+		"\n		dec r16"
+		"\n		brne 4b"
+		
+		"\n		mov r16, r19"		// erase image and installer from 0
+		"\n		subi r16, -(%[ipages])"
+		"\n		clr r30"
+		"\n		clr r31"
+		#ifdef RAMPZ
+		"\n		sts %[rampz], r30"
+		#endif
+		"\n		ldi r22, lo8(%[tail])"
+		"\n		ldi r23, hi8(%[tail])"
+		#if defined (EIND) || defined (__AVR_3_BYTE_PC__)
+		"\n		ldi r25, hh8(%[tail])"
+		#endif
+		"\n		rjmp 9f"
+		
+		// Copies page from Y to Z, advancing both
+		"\n	6:	wdr"
+		"\n		ldi r24, %[pgers]"
+		"\n		rcall 7f"
+		"\n		ldi r18, %[words]"
+		"\n	8:	movw r20, r30"
+		"\n		movw r30, r28"
+		"\n		lpm r0, Z+"
+		"\n		lpm r1, Z+"
+		"\n		movw r28, r30"
+		"\n		movw r30, r20"
+		"\n		ldi r24, %[fill]"
+		"\n		rcall 7f"
+		"\n		adiw r30, 2"
+		"\n		dec r18"
+		"\n		brne 8b"
+		"\n		sbiw r30, 2"
+		"\n		ldi r24, %[pgwrt]"
+		"\n		rcall 7f"
+		"\n		adiw r30, 2"
+		"\n		ret"
+		
+		// Calls do_spm1 if r17=0, otherwise do_spm2. Pushes it on stack
+		// rather than using ICALL, so Z can be used for address.
+		"\n	7:	ldi r22, lo8(%[spm1])"
+		"\n		ldi r23, hi8(%[spm1])"
+		#if defined (EIND) || defined (__AVR_3_BYTE_PC__)
+		"\n		ldi r25, hh8(%[spm1])"
+		#endif
+		"\n		tst r17"
+		"\n		breq 9f"
+		"\n		ldi r22, lo8(%[spm2])"
+		"\n		ldi r23, hi8(%[spm2])"
+		#if defined (EIND) || defined (__AVR_3_BYTE_PC__)
+		"\n		ldi r25, hh8(%[spm2])"
+		#endif
+		"\n	9:	push r22"
+		"\n		push r23"
+		#if defined (EIND) || defined (__AVR_3_BYTE_PC__)
+		"\n		push r25"			// RET uses 3 bytes on larger devices
+		#endif
+		"\n		ret"
+		
+		"\n	.if . - installerCode > %[size]"
+		"\n		.error \"installer_size too small\""
+		"\n	.endif"
+		"\n" ::
+		[spmcr]   "M" (&SPMCR),
+		#ifdef RAMPZ
+		[rampz]   "M" (&RAMPZ),
+		[bank]    "M" ((uint8_t) (BOOTLOADER_ADDRESS >> 16)),
+		#endif
+		[top]     "i" (INSTALL_TOP_PAGE),
+		[boot]    "i" (BOOTLOADER_ADDRESS),
+		[spm1]    "i" ((BOOTLOADER_ADDRESS + (uint32_t) spm_rdy_vect_num * _VECTOR_SIZE) / 2),
+		[spm2]    "i" (INSTALL_TOP_PAGE / 2 + 1), // after RJMP
+		[tail]    "i" ((INSTALL_TOP_PAGE + installer_tail) / 2),
+		[tailoff] "i" (installer_tail),
+		[ipages]  "M" (installer_pages),
+		[size]    "i" (installer_size),
+		DO_SPM_OPERANDS
+		);
+	}
+	
+	// Copies installer just after image staged at address 0 and runs it
+	static void installLoader( void ) __attribute__((noreturn));
+	static void installLoader( void )
+	{
+		_delay_ms( 2 ); // host's handshake for status stage
+		cli();
+		usbDeviceDisconnect();
+		eeprom_busy_wait();
+		boot_spm_busy_wait();
+		boot_rww_enable(); // clears page buffer
+		
+		#if FLASHEND > 0xFFFF
+			addr_t src = pgm_get_far_address( installerCode );
+		#else
+			addr_t src = (addr_t) installerCode;
+		#endif
+		uint16_t code = installPages * SPM_PAGESIZE;
+		addr_t dest = code;
+		uchar n = installer_pages;
+		do
+		{
+			boot_page_erase( dest );
+			boot_spm_busy_wait();
+			do
+			{
+				boot_page_fill( dest, PGM_READ_WORD( src ) );
+				src  += 2;
+				dest += 2;
+			}
+			while ( dest & (SPM_PAGESIZE - 1) );
+			boot_page_write( dest - 2 );
+			boot_spm_busy_wait();
+		}
+		while ( --n );
+		boot_rww_enable();
+		
+		wdt_enable( WDTO_120MS ); // installer resets it for each page
+		
+		register uchar    pages asm ("r16") = installPages;
+		register uint16_t self  asm ("r14") = code;
+		asm volatile ( "ijmp" :: "z" (code / 2), "r" (pages), "r" (self) );
+		__builtin_unreachable();
+	}
+#endif
+
+
+// **** Page programming service for user program
+
+#if HAVE_PAGE_SERVICE
+	// Called by usbasploaderProgramPage() (see usbasploader.h), via vector
+	// below. Program's interrupt handlers are in RWW section, so interrupts
+	// stay disabled until it's readable again.
+	static uchar __attribute__((used,noinline)) pageService( uint32_t addr,
+			const uint16_t* data )
+	{
+		addr &= ~(uint32_t) (SPM_PAGESIZE - 1);
+		if ( addr >= (uint32_t) BOOTLOADER_ADDRESS )
+			return usbasploader_refused;
+		
+		uchar sreg = SREG;
+		cli();
+		eeprom_busy_wait(); // SPM can't be done while EEPROM is being written
+		boot_spm_busy_wait();
+		
+		uchar changed    = 0;
+		uchar needsErase = 0;
+		addr_t a = addr;
+		const uint16_t* p = data;
+		do
+		{
+			uint16_t old  = PGM_READ_WORD( a );
+			uint16_t word = *p++;
+			if ( old != word )
+				changed = 1;
+			if ( (old & word) != word ) // programming can only clear bits
+				needsErase = 1;
+			boot_page_fill( a, word );
+			a += 2;
+		}
+		while ( a & (SPM_PAGESIZE - 1) );
+		
+		if ( changed )
+		{
+			if ( needsErase )
+			{
+				boot_page_erase( addr );
+				boot_spm_busy_wait();
+			}
+			boot_page_write( addr );
+			boot_spm_busy_wait();
+		}
+		boot_rww_enable(); // also clears page buffer if page wasn't written
+		
+		uchar result = usbasploader_ok;
+		a = addr;
+		p = data;
+		do
+		{
+			if ( PGM_READ_WORD( a ) != *p++ )
+				result = usbasploader_verify_failed;
+			a += 2;
+		}
+		while ( a & (SPM_PAGESIZE - 1) );
+		
+		SREG = sreg;
+		return result;
+	}
+	
+	ISR(USBASPLOADER_SERVICE_vect,ISR_NAKED)
+	{
+		asm volatile ( "%~jmp %x0" :: "i" (pageService) );
+	}
+#endif
+
+
 // **** Main program
 
 static void leaveBootloader( void )
 {
 	LED_EXIT();
 	cli();
-	usbDeviceDisconnect();
+	#if HAVE_USB_HANDOFF
+		// Stay attached if host has enumerated us, for program to take over
+		if ( !usbNewDeviceAddr )
+	#endif
+			usbDeviceDisconnect();
 	
 	USB_INTR_ENABLE = 0;
 	USB_INTR_CFG    = 0; // also reset config bits
 	
 	SET_IVSEL( 0 );
 	
+	#if HAVE_PROFILE || HAVE_TIMER_TIMEOUTS
+		TCCR1B = 0;
+		TCNT1  = 0;
+	#endif
+	
 	bootLoaderExit();
 	
+	#if HAVE_USB_HANDOFF
+		if ( usbNewDeviceAddr )
+		{
+			// Handoff at top of RAM only overwrites stack that's no longer
+			// needed, and IJMP pushes nothing more onto it
+			uchar addr   = usbNewDeviceAddr;
+			uchar config = usbConfiguration;
+			uchar token  = 0;
+			#if USB_CFG_HAVE_INTRIN_ENDPOINT
+				token = usbTxBuf1 [0];
+			#endif
+			volatile struct usbasploaderHandoff* h = USBASPLOADER_HANDOFF;
+			h->deviceAddr    = addr;
+			h->configuration = config;
+			h->dataToken1    = token;
+			h->magic         = USBASPLOADER_HANDOFF_MAGIC;
+			asm volatile ( "ijmp" :: "z" (0) );
+			__builtin_unreachable();
+		}
+	#endif
+	
 	// GCC doesn't set EIND when generating EICALL on devices with large flash.
 	#ifdef EIND
 		EIND = 0;
@@ -348,9 +1461,22 @@ static void initHardware( void )
 	
 	// Force USB re-enumerate so host sees us
 	usbDeviceDisconnect();
-	_delay_ms( 260 );
+	#if HAVE_FAST_ENTRY
+		if ( fastEntry )
+			_delay_ms( FAST_ENTRY_DISCONNECT_MS );
+		else
+	#endif
+			_delay_ms( 260 );
 	usbDeviceConnect();
 	
+	#if HAVE_PROFILE || HAVE_TIMER_TIMEOUTS
+		#if HAVE_FAST_ENTRY
+			TCCR1A = 0; // program might have left it in another mode
+			TCNT1  = 0; // and count anywhere, while timerLast starts at 0
+		#endif
+		TCCR1B = 1<<CS11 | 1<<CS10; // clk/64
+	#endif
+	
 	sei();
 	LED_INIT();
 }
@@ -360,25 +1486,80 @@ int main( void )
 {
 	#if USE_GLOBAL_REGS
 		currentRequest = currentRequest_init;
-		#if AUTO_EXIT_NO_USB_MS
+		#if AUTO_EXIT_NO_USB_MS && !HAVE_TIMER_TIMEOUTS
 			timeoutHigh = timeoutHigh_init;
 		#endif
 	#endif
 	
 	odDebugInit();
 	
-	// Allow user to see registers before any disruption
-	bootLoaderInit();
+	// Allow user to see registers before any disruption. Program asking for
+	// bootloader overrides usual entry condition.
+	if ( !FAST_ENTRY() )
+		bootLoaderInit();
+	
+	#ifdef usbPowerPresent
+		// Pins are still inputs without pull-ups, as reset left them. Skips
+		// USB reset delay and AUTO_EXIT_NO_USB_MS wait.
+		{
+			uchar n = USB_POWER_SAMPLES;
+			do
+			{
+				_delay_us( 10 );
+				if ( usbPowerPresent() )
+					break;
+			}
+			while ( --n );
+			if ( !n )
+				leaveBootloader();
+		}
+	#endif
 	
 	initHardware(); // gives time for jumper pull-ups to stabilize
 	
-	uchar i = 0; // tried unsigned int counter but added 60 bytes
-	uchar j = 0;
-	while ( bootLoaderCondition() )
+	#if !HAVE_TIMER_TIMEOUTS
+		uchar i = 0; // tried unsigned int counter but added 60 bytes
+		uchar j = 0;
+	#endif
+	while ( FAST_ENTRY() || bootLoaderCondition() )
 	{
 		wdt_reset(); // in case wdt is fused on
-		usbPoll();
+		PROF( prof_poll, usbPoll() );
+		#if HAVE_PROFILE
+			profTotal();
+		#endif
+		
+		#if HAVE_PIPELINED_WRITE
+			pollPage();
+		#endif
 		
+		#if HAVE_NOTIFY
+			pollNotify();
+		#endif
+		
+		#if HAVE_USB_UPDATE
+			if ( installPages && usbTxLen == USBPID_NAK )
+				installLoader();
+		#endif
+		
+	#if HAVE_TIMER_TIMEOUTS
+		// Catches up a millisecond per iteration after SPM/EEPROM waits
+		if ( (uint16_t) (TCNT1 - timerLast) >= timer_ms_ticks )
+		{
+			timerLast += timer_ms_ticks;
+			
+			if ( ++ledMs >= led_blink_ms )
+			{
+				ledMs = 0;
+				LED_BLINK();
+			}
+			
+			#if BOOTLOADER_CAN_EXIT
+				if ( currentRequest == USBASP_FUNC_DISCONNECT && --exitTimeout == 0 )
+					break;
+			#endif
+		}
+	#else
 		if ( --i == 0 )
 		{
 			if ( --j == 0 )
@@ -396,9 +1577,19 @@ int main( void )
 				#endif
 			}
 		}
-			
+	#endif
 	}
 	
+	#if HAVE_PIPELINED_WRITE || HAVE_EARLY_ERASE
+		finishPage();
+	#endif
+	
+	#if HAVE_FAST_EEPROM_WRITE && defined (EEPM0)
+		// User program might assume default erase+write mode
+		eeprom_busy_wait();
+		EECR = 0;
+	#endif
+	
 	leaveBootloader();
 }
 
@@ -406,7 +1597,12 @@ int main( void )
 #if AUTO_EXIT_NO_USB_MS
 	// TODO: less hacky approach (USB_RESET_HOOK took 18 bytes more code)
 	#undef DBG1
-	#if AUTO_EXIT_MS
+	#if AUTO_EXIT_MS && HAVE_TIMER_TIMEOUTS
+		#define DBG1( a, b, c ) {\
+			if ( (a) == 0xff )\
+				exitTimeout = AUTO_EXIT_MS;\
+		}
+	#elif AUTO_EXIT_MS
 		#define DBG1( a, b, c ) {\
 			if ( (a) == 0xff )\
 				timeoutHigh = F_CPU/main_loop_clk / 1000 * (AUTO_EXIT_MS) / 0x10000;\
@@ -419,5 +1615,26 @@ int main( void )
 	#endif
 #endif
 
+#if HAVE_READ_CRC
+	// usbBuildTxBlock() calls this right after usbFunctionRead(), whose CRC
+	// can then be used rather than going over data again
+	static void txCrcAppend( uchar* data, uchar len )
+	{
+		if ( txCrcReady )
+		{
+			txCrcReady = 0;
+			data [len    ] = txCrc;
+			data [len + 1] = txCrc >> 8;
+		}
+		else
+		{
+			usbCrc16Append( data, len );
+		}
+	}
+	
+	#undef  usbCrc16Append
+	#define usbCrc16Append( data, len ) txCrcAppend( data, len )
+#endif
+
 // at end so we don't mistakenly use some of its internal variables
 #include "usbdrv/usbdrv.c" // optimization: helps to have source in same file
@@ -1,11 +1,20 @@
 // Misc configuration here rather than source to avoid cluttering it with non-code
 
+#ifndef POSTCONFIG_H
+#define POSTCONFIG_H
+
 #if BOOTLOADER_ADDRESS % SPM_PAGESIZE != 0
 	#error "BOOTLOADER_ADDRESS must be on page boundary"
 #endif
 
+// With only 2K, some features are auto-disabled to fit (below). Speed
+// features and protocol extensions are off by default regardless of size,
+// since their code size hasn't been measured on every device and clock; they
+// can be enabled in bootloaderconfig.h where the boot section has room.
+#define BOOTLOADER_SIZE (FLASHEND + 1 - BOOTLOADER_ADDRESS)
+
 // Auto-disable features if only 2K bootloader space
-#if (FLASHEND - BOOTLOADER_ADDRESS) <= 0x800
+#if BOOTLOADER_SIZE <= 0x800
 	#if !defined (HAVE_READ_LOCK_FUSE) && (USB_CFG_CLOCK_KHZ == 15000 || \
 			USB_CFG_CLOCK_KHZ == 16500 || USB_CFG_CLOCK_KHZ == 12800)
 		#warning "Disabling HAVE_READ_LOCK_FUSE to fit code budget"
@@ -20,6 +29,9 @@
 		#warning "Disabling HAVE_EEPROM_BYTE_ACCESS to fit code budget"
 		#define HAVE_EEPROM_BYTE_ACCESS 0
 	#endif
+	#ifndef HAVE_FAST_EEPROM_WRITE
+		#define HAVE_FAST_EEPROM_WRITE 0 // not known to fit in 2K
+	#endif
 	#if !defined (HAVE_EEPROM_PAGED_ACCESS) && USB_CFG_CLOCK_KHZ == 12800
 		#warning "Disabling HAVE_EEPROM_PAGED_ACCESS to fit code budget"
 		#define HAVE_EEPROM_PAGED_ACCESS 0
@@ -32,6 +44,9 @@
 		#warning "Disabling BOOTLOADER_CAN_EXIT to fit code budget"
 		#define BOOTLOADER_CAN_EXIT 0
 	#endif
+	#ifndef HAVE_SKIP_UNCHANGED_PAGES
+		#define HAVE_SKIP_UNCHANGED_PAGES 0 // not known to fit in 2K
+	#endif
 	#if !defined (HAVE_SELF_UPDATE) && USB_CFG_CLOCK_KHZ == 12800
 		#define HAVE_SELF_UPDATE 0
 	#endif
@@ -99,9 +114,19 @@
 #endif
 
 #if BOOTLOADER_ON_JUMPER
-	// All macros to delay of not-yet-defined USB_OUTPORT()/USB_INPORT()
-	#define bootLoaderInit() \
-			{ USB_OUTPORT(BOOTLOADER_JUMPER_PORT) |= 1<<BOOTLOADER_JUMPER_BIT; }
+	#ifndef BOOTLOADER_JUMPER_SETTLE_US
+		#define BOOTLOADER_JUMPER_SETTLE_US 50
+	#endif
+	
+	// All macros to delay of not-yet-defined USB_OUTPORT()/USB_INPORT().
+	// Pull-up settles in microseconds, so user program can be run before USB
+	// is initialized.
+	#define bootLoaderInit() { \
+		USB_OUTPORT(BOOTLOADER_JUMPER_PORT) |= 1<<BOOTLOADER_JUMPER_BIT;\
+		_delay_us( BOOTLOADER_JUMPER_SETTLE_US );\
+		if ( !bootLoaderCondition() )\
+			leaveBootloader();\
+	}
 	
 	#define bootLoaderCondition() \
 			((USB_INPORT( BOOTLOADER_JUMPER_PORT) & (1<<BOOTLOADER_JUMPER_BIT)) == 0)
@@ -110,6 +135,37 @@
 			{ USB_OUTPORT(BOOTLOADER_JUMPER_PORT) &= ~(1<<BOOTLOADER_JUMPER_BIT); }
 #endif
 
+// USB power sensing, so user program runs right away when USB isn't connected.
+// Macros to delay use of not-yet-defined USB_INPORT().
+// Power is present if any of USB_POWER_SAMPLES reads, 10 us apart, is high.
+#if defined (BOOTLOADER_VBUS_PORT)
+	#define usbPowerPresent() \
+			(USB_INPORT( BOOTLOADER_VBUS_PORT ) & (1<<BOOTLOADER_VBUS_BIT))
+	#define USB_POWER_SAMPLES 1
+#elif BOOTLOADER_DMINUS_SENSE
+	#ifdef USB_CFG_PULLUP_IOPORTNAME
+		#error "BOOTLOADER_DMINUS_SENSE needs D- pull-up powered from VBUS, not switched by USB_CFG_PULLUP_IOPORTNAME"
+	#endif
+	#define usbPowerPresent() \
+			(USB_INPORT( USB_CFG_IOPORTNAME ) & (1<<USB_CFG_DMINUS_BIT))
+	#define USB_POWER_SAMPLES 100 // D- is low during EOPs, so cover about 1 ms
+#endif
+
+// Entry from program via usbasploaderEnter() (see usbasploader.h)
+#ifndef HAVE_FAST_ENTRY
+	#define HAVE_FAST_ENTRY 0
+#endif
+
+// Leave USB attached for program, passing it enumeration state (see
+// usbasploader.h)
+#ifndef HAVE_USB_HANDOFF
+	#define HAVE_USB_HANDOFF 0
+#endif
+
+#ifndef FAST_ENTRY_DISCONNECT_MS
+	#define FAST_ENTRY_DISCONNECT_MS 50
+#endif
+
 #ifndef bootLoaderCondition
 	static void bootLoaderInit( void ) { }
 	#define bootLoaderCondition() 1
@@ -144,6 +200,84 @@
 	#define HAVE_EEPROM_PAGED_ACCESS 1
 #endif
 
+#ifndef HAVE_FAST_EEPROM_WRITE
+	#define HAVE_FAST_EEPROM_WRITE 1
+#endif
+
+#ifndef HAVE_SKIP_UNCHANGED_PAGES
+	#define HAVE_SKIP_UNCHANGED_PAGES 1
+#endif
+
+// Time AUTO_EXIT_MS/AUTO_EXIT_NO_USB_MS and LED blinking with Timer1 rather
+// than by counting main loop iterations
+#ifndef HAVE_TIMER_TIMEOUTS
+	#define HAVE_TIMER_TIMEOUTS 0
+#endif
+
+// Speed features that cost code, off by default (see top)
+
+// Transfers of more than 254 bytes, for hosts that send more than a page at a
+// time
+#ifndef HAVE_LONG_TRANSFERS
+	#define HAVE_LONG_TRANSFERS 0
+#endif
+
+#ifndef HAVE_WRITE_CRC
+	#define HAVE_WRITE_CRC 0
+#endif
+
+#ifndef HAVE_READ_CRC
+	#define HAVE_READ_CRC 0
+#endif
+
+#ifndef HAVE_PIPELINED_WRITE
+	#define HAVE_PIPELINED_WRITE 0
+#endif
+
+// Erase page while rest of it is being received. Pipelined write already
+// overlaps receiving with programming, so this is only for when that's off.
+#if HAVE_PIPELINED_WRITE
+	#undef  HAVE_EARLY_ERASE
+	#define HAVE_EARLY_ERASE 0
+#elif !defined (HAVE_EARLY_ERASE)
+	#define HAVE_EARLY_ERASE 0
+#endif
+
+#ifndef HAVE_STREAM_WRITE
+	#define HAVE_STREAM_WRITE 0
+#endif
+
+#ifndef HAVE_CRC
+	#define HAVE_CRC 0
+#endif
+
+#ifndef HAVE_RANGE_ERASE
+	#define HAVE_RANGE_ERASE 0
+#endif
+
+#ifndef HAVE_PACKED_WRITE
+	#define HAVE_PACKED_WRITE 0
+#endif
+
+#ifndef HAVE_PROFILE
+	#define HAVE_PROFILE 0
+#endif
+
+// Flash page programming for user program (see usbasploader.h)
+#ifndef HAVE_PAGE_SERVICE
+	#define HAVE_PAGE_SERVICE 0
+#endif
+
+// do_spm page mode, for programs that call it (see do_spm.h)
+#ifndef HAVE_SPM_PAGE
+	#define HAVE_SPM_PAGE 0
+#endif
+
+// Install of new bootloader sent over USB, without an updater program
+#ifndef HAVE_USB_UPDATE
+	#define HAVE_USB_UPDATE 0
+#endif
+
 #ifndef USE_GLOBAL_REGS
 	#define USE_GLOBAL_REGS 1
 #endif
@@ -165,3 +299,13 @@
 #if !BOOTLOADER_CAN_EXIT
 	#undef AUTO_EXIT_NO_USB
 #endif
+
+#if HAVE_USB_UPDATE && defined (HAVE_SELF_UPDATE) && !HAVE_SELF_UPDATE
+	#error "HAVE_USB_UPDATE needs HAVE_SELF_UPDATE"
+#endif
+
+#if HAVE_TIMER_TIMEOUTS && AUTO_EXIT_MS > 0xFFFF
+	#error "AUTO_EXIT_MS must be 65535 or less"
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+// Mock of avr-libc's <avr/boot.h>. SPM operations go to the flash model,
+// which enforces the hardware's busy and page-buffer rules.
+
+#ifndef SIM_AVR_BOOT_H
+#define SIM_AVR_BOOT_H
+
+#include <avr/io.h>
+
+#define boot_page_fill( addr, data ) sim_spm( sim_spm_fill,  (addr), (data) )
+#define boot_page_erase( addr )      sim_spm( sim_spm_erase, (addr), 0 )
+#define boot_page_write( addr )      sim_spm( sim_spm_write, (addr), 0 )
+#define boot_rww_enable()            sim_spm( sim_spm_rww,   0, 0 )
+
+#define boot_spm_busy()              sim_spm_busy()
+#define boot_rww_busy()              sim_rww_busy()
+#define boot_spm_busy_wait()         sim_spm_busy_wait()
+
+#define GET_LOW_FUSE_BITS       0
+#define GET_LOCK_BITS           1
+#define GET_EXTENDED_FUSE_BITS  2
+#define GET_HIGH_FUSE_BITS      3
+
+#define boot_lock_fuse_bits_get( addr ) (sim_fuses [(addr) & 3])
+
+#endif
@@ -0,0 +1,35 @@
+// Mock of avr-libc's <avr/eeprom.h>. Implemented on top of the modeled
+// EEPROM registers the same way avr-libc does, so timing matches.
+
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <avr/io.h>
+
+#define eeprom_is_ready()  ((EECR & (1<<EEPE)) == 0)
+#define eeprom_busy_wait() do { } while ( !eeprom_is_ready() )
+
+static inline uint8_t eeprom_read_byte( const uint8_t* p )
+{
+	eeprom_busy_wait();
+	EEAR = (uintptr_t) p;
+	EECR |= 1<<EERE;
+	return EEDR;
+}
+
+static inline void eeprom_write_byte( uint8_t* p, uint8_t value )
+{
+	eeprom_busy_wait();
+	EEAR = (uintptr_t) p;
+	EEDR = value;
+	EECR = 1<<EEMPE; // atomic erase+write
+	EECR |= 1<<EEPE;
+}
+
+static inline void eeprom_update_byte( uint8_t* p, uint8_t value )
+{
+	if ( eeprom_read_byte( p ) != value )
+		eeprom_write_byte( p, value );
+}
+
+#endif
@@ -0,0 +1,16 @@
+// Mock of avr-libc's <avr/interrupt.h>. The USB interrupt handler is
+// emulated by the host side between main loop iterations, so interrupt
+// state only needs to be tracked.
+
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define sei() (SREG |=  0x80)
+#define cli() (SREG &= ~0x80)
+
+#define ISR_NAKED
+#define ISR( vector, ... ) void vector( void )
+
+#endif
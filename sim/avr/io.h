@@ -0,0 +1,210 @@
+// Mock of avr-libc's <avr/io.h> for the host-side emulator. Registers are
+// plain memory, except for the EEPROM ones which are routed through the
+// EEPROM model. Device is selected by SIM_DEVICE_NUM, the number from
+// atmegaNN as determined by devices.inc.
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+#include "sim.h"
+
+#ifndef SIM_DEVICE_NUM
+	#define SIM_DEVICE_NUM 8
+#endif
+
+//**** Memory geometry
+
+// SIM_NRWW_START: start of No-Read-While-Write section (largest boot section)
+// SIM_HAVE_EEPM:  EEPROM supports split erase/write modes
+
+#if SIM_DEVICE_NUM == 8
+	#define FLASHEND        0x1FFF
+	#define E2END           0x1FF
+	#define SPM_PAGESIZE    64
+	#define SIM_NRWW_START  0x1800
+	#define SIGNATURE_1     0x93
+	#define SIGNATURE_2     0x07
+#elif SIM_DEVICE_NUM == 88
+	#define FLASHEND        0x1FFF
+	#define E2END           0x1FF
+	#define SPM_PAGESIZE    64
+	#define SIM_NRWW_START  0x1800
+	#define SIGNATURE_1     0x93
+	#define SIGNATURE_2     0x0A
+#elif SIM_DEVICE_NUM == 16
+	#define FLASHEND        0x3FFF
+	#define E2END           0x1FF
+	#define SPM_PAGESIZE    128
+	#define SIM_NRWW_START  0x3800
+	#define SIGNATURE_1     0x94
+	#define SIGNATURE_2     0x03
+#elif SIM_DEVICE_NUM == 168
+	#define FLASHEND        0x3FFF
+	#define E2END           0x1FF
+	#define SPM_PAGESIZE    128
+	#define SIM_NRWW_START  0x3800
+	#define SIGNATURE_1     0x94
+	#define SIGNATURE_2     0x06
+#elif SIM_DEVICE_NUM == 32
+	#define FLASHEND        0x7FFF
+	#define E2END           0x3FF
+	#define SPM_PAGESIZE    128
+	#define SIM_NRWW_START  0x7000
+	#define SIGNATURE_1     0x95
+	#define SIGNATURE_2     0x02
+#elif SIM_DEVICE_NUM == 328
+	#define FLASHEND        0x7FFF
+	#define E2END           0x3FF
+	#define SPM_PAGESIZE    128
+	#define SIM_NRWW_START  0x7000
+	#define SIGNATURE_1     0x95
+	#define SIGNATURE_2     0x14
+#elif SIM_DEVICE_NUM == 644
+	#define FLASHEND        0xFFFF
+	#define E2END           0x7FF
+	#define SPM_PAGESIZE    256
+	#define SIM_NRWW_START  0xE000
+	#define SIGNATURE_1     0x96
+	#define SIGNATURE_2     0x09
+#elif SIM_DEVICE_NUM == 1284
+	#define FLASHEND        0x1FFFF
+	#define E2END           0xFFF
+	#define SPM_PAGESIZE    256
+	#define SIM_NRWW_START  0x1E000
+	#define SIGNATURE_1     0x97
+	#define SIGNATURE_2     0x06
+#elif SIM_DEVICE_NUM == 2560
+	#define FLASHEND        0x3FFFF
+	#define E2END           0xFFF
+	#define SPM_PAGESIZE    256
+	#define SIM_NRWW_START  0x3E000
+	#define SIGNATURE_1     0x98
+	#define SIGNATURE_2     0x01
+#else
+	#error "Device not supported by emulator"
+#endif
+
+#define SIGNATURE_0 0x1E
+#define RAMEND      0x8FF
+
+#if SIM_DEVICE_NUM == 8 || SIM_DEVICE_NUM == 16 || SIM_DEVICE_NUM == 32
+	#define SIM_HAVE_EEPM 0
+#else
+	#define SIM_HAVE_EEPM 1
+#endif
+
+//**** Registers
+
+#define _SFR_IO8( addr ) (sim_io [(addr) + 0x20])
+#define _BV( bit ) (1 << (bit))
+
+#define SREG    _SFR_IO8( 0x3F )
+#define SPMCSR  _SFR_IO8( 0x37 )
+
+#define PINA    _SFR_IO8( 0x00 )
+#define DDRA    _SFR_IO8( 0x01 )
+#define PORTA   _SFR_IO8( 0x02 )
+
+#if !SIM_HAVE_EEPM // atmega8-style register set
+	#define PINB    _SFR_IO8( 0x16 )
+	#define DDRB    _SFR_IO8( 0x17 )
+	#define PORTB   _SFR_IO8( 0x18 )
+	#define PINC    _SFR_IO8( 0x13 )
+	#define DDRC    _SFR_IO8( 0x14 )
+	#define PORTC   _SFR_IO8( 0x15 )
+	#define PIND    _SFR_IO8( 0x10 )
+	#define DDRD    _SFR_IO8( 0x11 )
+	#define PORTD   _SFR_IO8( 0x12 )
+
+	#define MCUCSR  _SFR_IO8( 0x34 )
+	#define MCUCR   _SFR_IO8( 0x35 )
+	#define GIFR    _SFR_IO8( 0x3A )
+	#define GICR    _SFR_IO8( 0x3B )
+	#define WDTCR   _SFR_IO8( 0x21 )
+	#define SPMCR   SPMCSR
+
+	#define WDTOE   4
+
+	#define SIM_EECR _SFR_IO8( 0x1C )
+	#define SIM_EEDR _SFR_IO8( 0x1D )
+	#define EERE    0
+	#define EEWE    1
+	#define EEMWE   2
+	#define EEPE    EEWE
+	#define EEMPE   EEMWE
+#else // atmega88-style register set
+	#define PINB    _SFR_IO8( 0x03 )
+	#define DDRB    _SFR_IO8( 0x04 )
+	#define PORTB   _SFR_IO8( 0x05 )
+	#define PINC    _SFR_IO8( 0x06 )
+	#define DDRC    _SFR_IO8( 0x07 )
+	#define PORTC   _SFR_IO8( 0x08 )
+	#define PIND    _SFR_IO8( 0x09 )
+	#define DDRD    _SFR_IO8( 0x0A )
+	#define PORTD   _SFR_IO8( 0x0B )
+
+	#define EIFR    _SFR_IO8( 0x1C )
+	#define EIMSK   _SFR_IO8( 0x1D )
+	#define MCUSR   _SFR_IO8( 0x34 )
+	#define MCUCR   _SFR_IO8( 0x35 )
+	#define WDTCSR  _SFR_IO8( 0x40 )
+	#define EICRA   _SFR_IO8( 0x49 )
+
+	#define WDCE    4
+
+	#define SIM_EECR _SFR_IO8( 0x1F )
+	#define SIM_EEDR _SFR_IO8( 0x20 )
+	#define EERE    0
+	#define EEPE    1
+	#define EEMPE   2
+	#define EEPM0   4
+	#define EEPM1   5
+
+	#if FLASHEND > 0xFFFF
+		#define RAMPZ   _SFR_IO8( 0x3B )
+	#endif
+	#if FLASHEND > 0x1FFFF
+		#define EIND    _SFR_IO8( 0x3C )
+	#endif
+#endif
+
+// Timer1 counts modeled time when clock select bits are set
+#define TCCR1A  (sim_io [0x80])
+#define TCCR1B  (sim_io [0x81])
+#define TCNT1   (*sim_timer1())
+
+#define EECR    (*sim_ee_reg( &SIM_EECR ))
+#define EEDR    (*sim_ee_reg( &SIM_EEDR ))
+#define EEAR    (*sim_ee_addr())
+#define EEARL   (((volatile uint8_t*) sim_ee_addr()) [0])
+#define EEARH   (((volatile uint8_t*) sim_ee_addr()) [1])
+
+// Bits
+#define ISC00   0
+#define ISC01   1
+#define INT0    6
+#define INTF0   6
+#define IVCE    0
+#define IVSEL   1
+#define WDP0    0
+#define WDP1    1
+#define WDP2    2
+#define WDE     3
+#define PORF    0
+#define EXTRF   1
+#define BORF    2
+#define WDRF    3
+
+#define CS10    0
+#define CS11    1
+#define CS12    2
+
+#define SPMEN   0
+#define PGERS   1
+#define PGWRT   2
+#define BLBSET  3
+#define RWWSRE  4
+#define RWWSB   6
+
+#endif
@@ -0,0 +1,19 @@
+// Mock of avr-libc's <avr/pgmspace.h>. Program memory reads come from the
+// flash model. PROGMEM data stays in host memory; usbdrv only reads it for
+// descriptors, which the emulated host never requests.
+
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <avr/io.h>
+
+#define PROGMEM
+
+#define pgm_read_byte( addr )      sim_pgm_read_byte( (uintptr_t) (addr) )
+#define pgm_read_byte_far( addr )  sim_pgm_read_byte( (uintptr_t) (addr) )
+
+#define pgm_read_word( addr ) \
+	(sim_pgm_read_byte( (uintptr_t) (addr) ) | sim_pgm_read_byte( (uintptr_t) (addr) + 1 ) << 8)
+#define pgm_read_word_far( addr ) pgm_read_word( addr )
+
+#endif
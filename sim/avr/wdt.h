@@ -0,0 +1,15 @@
+// Mock of avr-libc's <avr/wdt.h>. The bootloader resets the watchdog once
+// per main loop iteration, so this is where the emulated host gets control.
+
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#include <avr/io.h>
+
+#define WDTO_15MS 0
+
+#define wdt_reset()      sim_main_loop()
+#define wdt_enable( t )  ((void) (t))
+#define wdt_disable()
+
+#endif
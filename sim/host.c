@@ -0,0 +1,1178 @@
+// Emulated USB host for the bootloader. Replays a USBasp session, or
+// generates one the way avrdude would for an image, models low-speed bus
+// timing, and reports modeled programming time and flash operation counts.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <avr/io.h>
+
+#include "sim.h"
+
+enum {
+	usbasp_connect          = 1,
+	usbasp_disconnect       = 2,
+	usbasp_transmit         = 3,
+	usbasp_readflash        = 4,
+	usbasp_enableprog       = 5,
+	usbasp_writeflash       = 6,
+	usbasp_readeeprom       = 7,
+	usbasp_writeeeprom      = 8,
+	usbasp_setlongaddress   = 9,
+	usbasp_setispsck        = 10,
+	usbasp_writeflashpacked = 32,
+	usbasp_crcflash         = 33,
+	usbasp_crceeprom        = 34,
+	usbasp_eraserange       = 35,
+	usbasp_getprofile       = 36,
+	usbasp_streamflash      = 37,
+	usbasp_getcapabilities  = 127
+};
+
+// avrdude's usbasp.c block size and flags, and delays in microseconds
+enum { avrdude_block = 200 };
+enum { blockflag_first = 1, blockflag_last = 2 };
+enum { notify_interval = 10000 }; // USB_CFG_INTR_POLL_INTERVAL
+enum { connect_delay = 100000, chip_erase_delay = 9000, transfer_timeout = 5000000 };
+enum { eeprom_page = (E2END < 0x400 ? 4 : 8) }; // from avrdude.conf
+
+// Low-speed USB packet sizes in bits (including sync, PID and EOP), and
+// time between packets of a transaction
+enum { token_bits = 35, data_bits = 35, handshake_bits = 19, gap_bits = 4 };
+static const double bit_us = 1 / 1.5;
+
+struct transfer_t {
+	uint8_t  in;      // device-to-host
+	uint8_t  request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	uint8_t* data;    // OUT data, or expected IN data (NULL if not checked)
+	double   delay;   // host delay before transfer
+	long     flash;   // flash bytes covered by erase range, or by packed stream this transfer ends
+};
+
+static struct transfer_t* transfers;
+static size_t transfer_count;
+
+static struct {
+	double transfer_gap; // host turnaround between transfers
+	int    frame_limit;  // maximum transactions per 1 ms frame (0 = no limit)
+	double exit_timeout; // how long to wait for bootloader to exit after session
+	int    block;        // maximum bytes per paged read/write transfer
+	int    packed;       // write flash with USBASP_FUNC_WRITEFLASHPACKED
+	int    stream;       // write flash with USBASP_FUNC_STREAMFLASH
+	int    crc_verify;   // verify with USBASP_FUNC_CRCFLASH/CRCEEPROM
+	int    erase_blank;  // erase blank pages with USBASP_FUNC_ERASERANGE
+	int    profile;      // read device's profile with USBASP_FUNC_GETPROFILE
+	int    bad_crc;      // give every Nth OUT data packet a bad CRC (0 = none)
+	int    notify;       // poll interrupt-in endpoint for notifications
+	int    verbose;
+} opt = { 1000, 0, 5000000, avrdude_block, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static uint8_t* image;        // flash image written by generated session
+static long     image_size;
+static uint8_t* eeprom_image;
+static long     eeprom_size;
+static long     packed_size;  // size of image after packing
+
+// Device's profile (see HAVE_PROFILE in main.c): 32-bit tick counts, then
+// 16-bit transfer and page counts
+enum { profile_ticks = 6, profile_size = profile_ticks * 4 + 4 };
+static uint8_t  profile [profile_size];
+static int      profile_read;
+
+
+// **** Session
+
+static struct transfer_t* add_transfer( int in, int request, unsigned value,
+		unsigned index, unsigned length )
+{
+	static size_t alloc;
+	if ( transfer_count >= alloc )
+	{
+		alloc = alloc * 2 + 64;
+		transfers = realloc( transfers, alloc * sizeof *transfers );
+		if ( !transfers )
+			abort();
+	}
+
+	struct transfer_t* t = &transfers [transfer_count++];
+	memset( t, 0, sizeof *t );
+	t->in      = in;
+	t->request = request;
+	t->value   = value;
+	t->index   = index;
+	t->length  = length;
+	return t;
+}
+
+static void add_delay( double us )
+{
+	// Applies to next transfer added
+	add_transfer( 0, 0, 0, 0, 0 )->delay = us;
+	transfer_count--;
+}
+
+static uint8_t* copy_data( const uint8_t* in, long size )
+{
+	uint8_t* p = malloc( size + 1 );
+	if ( !p )
+		abort();
+	memcpy( p, in, size );
+	return p;
+}
+
+static int hex_digit( int c )
+{
+	if ( c >= '0' && c <= '9' ) return c - '0';
+	if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
+
+// Parses session file. Each line is one of the following, with optional data
+// given as hex digits (whitespace allowed between bytes):
+//     out REQUEST VALUE INDEX [DATA]
+//     in  REQUEST VALUE INDEX LENGTH [EXPECTED-DATA]
+//     delay MICROSECONDS
+static void read_session( const char* path )
+{
+	FILE* f = fopen( path, "r" );
+	if ( !f )
+	{
+		perror( path );
+		exit( EXIT_FAILURE );
+	}
+
+	char*  line = NULL;
+	size_t line_size = 0;
+	int    line_num = 0;
+	double delay = 0;
+	while ( getline( &line, &line_size, f ) >= 0 )
+	{
+		line_num++;
+
+		char* p = line;
+		char* cmd = strtok( p, " \t\r\n" );
+		if ( !cmd || *cmd == '#' )
+			continue;
+
+		if ( !strcmp( cmd, "delay" ) )
+		{
+			delay += strtod( strtok( NULL, " \t\r\n" ), NULL );
+			continue;
+		}
+
+		int in = !strcmp( cmd, "in" );
+		if ( !in && strcmp( cmd, "out" ) )
+		{
+			fprintf( stderr, "%s:%d: unknown command '%s'\n", path, line_num, cmd );
+			exit( EXIT_FAILURE );
+		}
+
+		unsigned long field [4] = { 0 };
+		int n;
+		for ( n = 0; n < 3 + in; n++ )
+		{
+			char* s = strtok( NULL, " \t\r\n" );
+			if ( !s )
+			{
+				fprintf( stderr, "%s:%d: missing field\n", path, line_num );
+				exit( EXIT_FAILURE );
+			}
+			field [n] = strtoul( s, NULL, 0 );
+		}
+
+		// Remaining text is hex data
+		uint8_t* data = malloc( line_size / 2 + 1 );
+		long size = 0;
+		int hi = -1;
+		char* s;
+		while ( (s = strtok( NULL, " \t\r\n" )) != NULL )
+		{
+			for ( ; *s; s++ )
+			{
+				int d = hex_digit( *s );
+				if ( d < 0 )
+				{
+					fprintf( stderr, "%s:%d: bad hex data\n", path, line_num );
+					exit( EXIT_FAILURE );
+				}
+				if ( hi < 0 )
+				{
+					hi = d;
+				}
+				else
+				{
+					data [size++] = hi << 4 | d;
+					hi = -1;
+				}
+			}
+		}
+
+		struct transfer_t* t = add_transfer( in, field [0], field [1], field [2],
+				in ? field [3] : size );
+		t->delay = delay;
+		delay = 0;
+		if ( size )
+			t->data = data;
+		else
+			free( data );
+	}
+
+	free( line );
+	fclose( f );
+}
+
+static void write_session( const char* path )
+{
+	FILE* f = fopen( path, "w" );
+	if ( !f )
+	{
+		perror( path );
+		exit( EXIT_FAILURE );
+	}
+
+	fprintf( f, "# USBasp session: out REQUEST VALUE INDEX [DATA], "
+			"in REQUEST VALUE INDEX LENGTH [EXPECTED], delay US\n" );
+
+	size_t i;
+	for ( i = 0; i < transfer_count; i++ )
+	{
+		const struct transfer_t* t = &transfers [i];
+		if ( t->delay )
+			fprintf( f, "delay %.0f\n", t->delay );
+
+		fprintf( f, "%s %d 0x%04X 0x%04X", (t->in ? "in" : "out"),
+				t->request, t->value, t->index );
+		if ( t->in )
+			fprintf( f, " %u", t->length );
+
+		if ( t->data )
+		{
+			fprintf( f, " " );
+			unsigned n;
+			for ( n = 0; n < t->length; n++ )
+				fprintf( f, "%02X", t->data [n] );
+		}
+		fprintf( f, "\n" );
+	}
+
+	fclose( f );
+}
+
+
+// **** avrdude session generation
+
+// Same as usbasp_spi_cmd(): four SPI command bytes, four reply bytes
+static void gen_cmd( int b0, int b1, int b2, int b3 )
+{
+	add_transfer( 1, usbasp_transmit, b1 << 8 | b0, b3 << 8 | b2, 4 );
+}
+
+// Same as usbasp_initialize()
+static void gen_initialize( void )
+{
+	add_transfer( 1, usbasp_getcapabilities, 0, 0, 4 );
+	add_transfer( 1, usbasp_setispsck, 0, 0, 4 );
+	add_transfer( 1, usbasp_connect, 0, 0, 4 );
+	add_delay( connect_delay );
+	add_transfer( 1, usbasp_enableprog, 0, 0, 4 );
+}
+
+// Same as avr_write()/avr_read() calling usbasp_spi_paged_write()/load() for
+// each page from begin to size. If block is larger than a page, transfers
+// cover multiple pages, as a host using long transfers would do.
+static void gen_paged( int write, int request, const uint8_t* mem, long begin,
+		long size, int page_size, int block )
+{
+	long span = page_size;
+	if ( block > page_size )
+		span = block / page_size * page_size;
+
+	long start;
+	for ( start = begin; start < size; start += span )
+	{
+		long end = start + span;
+		if ( end > size )
+			end = size;
+
+		long addr  = start;
+		int  flags = blockflag_first;
+		while ( addr < end )
+		{
+			int n = block;
+			if ( n > end - addr )
+				n = end - addr;
+			if ( addr + n == end )
+				flags |= blockflag_last;
+
+			add_transfer( 1, usbasp_setlongaddress, addr & 0xFFFF, addr >> 16, 4 );
+
+			unsigned index = 0;
+			if ( write )
+				index = ((flags & 0x0F) + ((page_size & 0xF00) >> 4)) << 8 |
+						(page_size & 0xFF);
+
+			struct transfer_t* t = add_transfer( !write, request, addr & 0xFFFF,
+					index, n );
+			t->data = copy_data( mem + addr, n );
+
+			flags = 0;
+			addr += n;
+		}
+	}
+}
+
+static int page_blank( const uint8_t* page )
+{
+	int i;
+	for ( i = 0; i < SPM_PAGESIZE; i++ )
+		if ( page [i] != 0xFF )
+			return 0;
+	return 1;
+}
+
+// Writes flash, but erases runs of blank pages rather than sending them.
+// Erase ranges don't cross 64K, since they share upper address word.
+static void gen_sparse( const uint8_t* mem, long size, int block )
+{
+	long addr = 0;
+	while ( addr < size )
+	{
+		int  blank = page_blank( mem + addr );
+		long end = addr;
+		do
+			end += SPM_PAGESIZE;
+		while ( end < size && page_blank( mem + end ) == blank &&
+				(!blank || (end & 0xFFFF)) );
+
+		if ( blank )
+		{
+			add_transfer( 1, usbasp_setlongaddress, 0, addr >> 16, 4 );
+			struct transfer_t* t = add_transfer( 1, usbasp_eraserange,
+					addr & 0xFFFF, end & 0xFFFF, 0 );
+			t->flash = end - addr;
+		}
+		else
+		{
+			gen_paged( 1, usbasp_writeflash, mem, addr, end, SPM_PAGESIZE, block );
+		}
+		addr = end;
+	}
+}
+
+// Packs data into format USBASP_FUNC_WRITEFLASHPACKED takes (see main.c).
+// Greedy: takes longest run or repeat at each position.
+static long pack( const uint8_t* in, long size, uint8_t* out )
+{
+	long n   = 0;
+	long lit = -1; // position of current literal token
+	long pos = 0;
+	while ( pos < size )
+	{
+		int run = 0;
+		if ( in [pos] == 0x00 || in [pos] == 0xFF )
+			while ( run < 32 && pos + run < size && in [pos + run] == in [pos] )
+				run++;
+
+		int rep = 0;
+		int rep_off = 0;
+		int off;
+		for ( off = 1; off <= 256 && off <= pos; off++ )
+		{
+			int len = 0;
+			while ( len < 66 && pos + len < size && in [pos + len] == in [pos - off + len] )
+				len++;
+			if ( len > rep )
+			{
+				rep = len;
+				rep_off = off;
+			}
+		}
+
+		if ( run >= 2 && run >= rep )
+		{
+			out [n++] = 0x80 | (in [pos] ? 0x20 : 0) | (run - 1);
+			pos += run;
+			lit = -1;
+		}
+		else if ( rep >= 3 )
+		{
+			out [n++] = 0xC0 | (rep - 3);
+			out [n++] = rep_off - 1;
+			pos += rep;
+			lit = -1;
+		}
+		else
+		{
+			if ( lit < 0 || out [lit] == 0x7F )
+			{
+				lit = n++;
+				out [lit] = 0;
+			}
+			else
+			{
+				out [lit]++;
+			}
+			out [n++] = in [pos++];
+		}
+	}
+	return n;
+}
+
+// Writes flash as one packed stream, split into transfers
+static void gen_packed( const uint8_t* mem, long size, int block )
+{
+	uint8_t* packed = malloc( size * 2 + 1 );
+	long n = pack( mem, size, packed );
+	packed_size += n;
+
+	add_transfer( 1, usbasp_setlongaddress, 0, 0, 4 );
+
+	long pos;
+	for ( pos = 0; pos < n; pos += block )
+	{
+		int len = block;
+		if ( len > n - pos )
+			len = n - pos;
+
+		int flags = 0;
+		if ( pos == 0 )
+			flags |= blockflag_first;
+		if ( pos + len == n )
+			flags |= blockflag_last;
+
+		struct transfer_t* t = add_transfer( 0, usbasp_writeflashpacked, 0,
+				flags << 8, len );
+		t->data = copy_data( packed + pos, len );
+		if ( flags & blockflag_last )
+			t->flash = size;
+	}
+
+	free( packed );
+}
+
+// Writes flash as one stream of transfers that continue where previous left off
+static void gen_stream( const uint8_t* mem, long size, int block )
+{
+	long pos;
+	for ( pos = 0; pos < size; pos += block )
+	{
+		int len = block;
+		if ( len > size - pos )
+			len = size - pos;
+
+		int flags = 0;
+		if ( pos == 0 )
+			flags |= blockflag_first;
+		if ( pos + len == size )
+			flags |= blockflag_last;
+
+		struct transfer_t* t = add_transfer( 0, usbasp_streamflash, 0,
+				flags << 8, len );
+		t->data = copy_data( mem + pos, len );
+	}
+}
+
+// Same as avr-libc's _crc16_update(), which device uses
+static uint16_t crc16_update( uint16_t crc, uint8_t b )
+{
+	crc ^= b;
+	int i;
+	for ( i = 0; i < 8; i++ )
+		crc = (crc & 1 ? crc >> 1 ^ 0xA001 : crc >> 1);
+	return crc;
+}
+
+// Verifies memory by having device checksum it, in chunks of up to 64K
+static void gen_crc( int request, const uint8_t* mem, long size )
+{
+	long addr;
+	for ( addr = 0; addr < size; addr += 0x10000 )
+	{
+		long n = size - addr;
+		if ( n > 0x10000 )
+			n = 0x10000;
+
+		uint16_t crc = 0xFFFF;
+		long i;
+		for ( i = 0; i < n; i++ )
+			crc = crc16_update( crc, mem [addr + i] );
+
+		if ( request == usbasp_crcflash )
+			add_transfer( 1, usbasp_setlongaddress, 0, addr >> 16, 4 );
+
+		struct transfer_t* t = add_transfer( 1, request, addr & 0xFFFF, n & 0xFFFF, 2 );
+		t->data = malloc( 2 );
+		t->data [0] = crc;
+		t->data [1] = crc >> 8;
+	}
+}
+
+// Pads image to whole pages, after trimming trailing 0xFF as avrdude does
+static long pad_image( uint8_t** mem, long size, int page_size )
+{
+	while ( size && (*mem) [size - 1] == 0xFF )
+		size--;
+
+	long padded = (size + page_size - 1) / page_size * page_size;
+	*mem = realloc( *mem, padded + 1 );
+	memset( *mem + size, 0xFF, padded - size );
+	return padded;
+}
+
+static void generate_session( int erase, int verify )
+{
+	gen_initialize();
+
+	int i;
+	for ( i = 0; i < 3; i++ )
+		gen_cmd( 0x30, 0, i, 0 ); // signature
+
+	gen_cmd( 0x50, 0x00, 0, 0 ); // safemode reads fuses
+	gen_cmd( 0x58, 0x08, 0, 0 );
+
+	if ( erase )
+	{
+		gen_cmd( 0xAC, 0x80, 0, 0 );
+		add_delay( chip_erase_delay );
+		gen_initialize();
+	}
+
+	// Final memory check then covers only what was written
+	if ( image )
+		image_size = pad_image( &image, image_size, SPM_PAGESIZE );
+	if ( eeprom_image )
+		eeprom_size = pad_image( &eeprom_image, eeprom_size, eeprom_page );
+	long flash_size = (image        ? image_size  : 0);
+	long eeprom_pad = (eeprom_image ? eeprom_size : 0);
+
+	if ( opt.packed && flash_size )
+		gen_packed( image, flash_size, opt.block );
+	else if ( opt.stream && flash_size )
+		gen_stream( image, flash_size, opt.block );
+	else if ( opt.erase_blank )
+		gen_sparse( image, flash_size, opt.block );
+	else
+		gen_paged( 1, usbasp_writeflash, image, 0, flash_size, SPM_PAGESIZE, opt.block );
+	gen_paged( 1, usbasp_writeeeprom, eeprom_image, 0, eeprom_pad, eeprom_page, opt.block );
+
+	if ( verify && opt.crc_verify )
+	{
+		gen_crc( usbasp_crcflash, image, flash_size );
+		gen_crc( usbasp_crceeprom, eeprom_image, eeprom_pad );
+	}
+	else if ( verify )
+	{
+		gen_paged( 0, usbasp_readflash, image, 0, flash_size, SPM_PAGESIZE, opt.block );
+		gen_paged( 0, usbasp_readeeprom, eeprom_image, 0, eeprom_pad, eeprom_page, opt.block );
+	}
+
+	if ( opt.profile )
+		add_transfer( 1, usbasp_getprofile, 0, 0, profile_size );
+
+	gen_cmd( 0x50, 0x00, 0, 0 );
+	gen_cmd( 0x58, 0x08, 0, 0 );
+
+	add_transfer( 1, usbasp_disconnect, 0, 0, 4 );
+}
+
+
+// **** Bus
+
+enum { phase_idle, phase_setup, phase_data, phase_status, phase_done };
+
+static struct {
+	size_t   cur;
+	int      phase;
+	unsigned pos;
+	double   ready;      // time next transaction may start
+	double   start;      // time current transfer started
+	double   prev_end;   // time previous transfer finished
+	double   begin;      // time session started
+	double   end;        // time session finished
+	long     frame;
+	int      frame_transactions;
+	unsigned long mismatches;
+	unsigned long stalls;
+	unsigned long timeouts;
+	unsigned long out_packets;
+	unsigned long payload;
+	unsigned long flash_written;
+	double   next_notify_poll;
+	unsigned long notify_reports;
+	uint8_t  notify_events;  // all event flags reported
+	uint8_t  notify [8];     // most recent report
+	double   phase_time [4]; // flash write, EEPROM write, read, other
+	uint8_t  in [65536 + 8];
+} host;
+
+// Transaction occupies bus; device is in interrupt handler for all of it
+static void transaction( int bits )
+{
+	host.frame_transactions++;
+	sim_delay_us( bits * bit_us );
+}
+
+static void transaction_out( int size )
+{
+	transaction( token_bits + gap_bits + data_bits + size * 8 + gap_bits + handshake_bits );
+}
+
+static void transaction_in( int size )
+{
+	if ( size < 0 )
+		transaction( token_bits + gap_bits + handshake_bits );
+	else
+		transaction( token_bits + gap_bits + data_bits + size * 8 + gap_bits + handshake_bits );
+}
+
+static void finish_transfer( void )
+{
+	struct transfer_t* t = &transfers [host.cur];
+
+	if ( t->in && t->data )
+	{
+		unsigned n;
+		for ( n = 0; n < t->length; n++ )
+			if ( n >= host.pos || host.in [n] != t->data [n] )
+				host.mismatches++;
+	}
+
+	host.payload += t->length;
+
+	if ( t->in && t->request == usbasp_getprofile && host.pos >= profile_size )
+	{
+		memcpy( profile, host.in, profile_size );
+		profile_read = 1;
+	}
+
+	int category = 3;
+	if ( t->request == usbasp_writeflash || t->request == usbasp_streamflash )
+	{
+		category = 0;
+		host.flash_written += t->length;
+	}
+	else if ( t->request == usbasp_writeflashpacked || t->request == usbasp_eraserange )
+	{
+		category = 0;
+		host.flash_written += t->flash;
+	}
+	else if ( t->request == usbasp_writeeeprom )
+	{
+		category = 1;
+	}
+	else if ( t->request == usbasp_readflash || t->request == usbasp_readeeprom ||
+			t->request == usbasp_crcflash || t->request == usbasp_crceeprom )
+	{
+		category = 2;
+	}
+
+	// Address setup goes with the data transfer following it
+	if ( t->request == usbasp_setlongaddress && host.cur + 1 < transfer_count )
+	{
+		int next = transfers [host.cur + 1].request;
+		if ( next == usbasp_writeflash || next == usbasp_writeflashpacked ||
+				next == usbasp_eraserange )
+			category = 0;
+		else if ( next == usbasp_writeeeprom )
+			category = 1;
+		else if ( next == usbasp_readflash || next == usbasp_readeeprom ||
+				next == usbasp_crcflash )
+			category = 2;
+	}
+	// Includes host's delay before transfer, so phases add up to session time
+	host.phase_time [category] += sim_now - host.prev_end;
+	host.prev_end = sim_now;
+
+	if ( opt.verbose )
+		printf( "%10.3f ms  %-3s %3d 0x%04X 0x%04X %5u  %.3f ms\n", sim_now / 1000,
+				(t->in ? "in" : "out"), t->request, t->value, t->index, t->length,
+				(sim_now - host.start) / 1000 );
+
+	host.cur++;
+	host.phase = phase_idle;
+	if ( host.cur >= transfer_count )
+	{
+		host.phase = phase_done;
+		host.end = sim_now;
+	}
+	else
+	{
+		host.ready = sim_now + opt.transfer_gap + transfers [host.cur].delay;
+	}
+}
+
+static void report( int exited );
+
+void sim_host_poll( void )
+{
+	if ( host.phase == phase_done )
+	{
+		if ( sim_now > host.end + opt.exit_timeout )
+		{
+			report( 0 );
+			exit( EXIT_FAILURE );
+		}
+		return;
+	}
+
+	// Interrupt-in endpoint is polled at its interval regardless of transfers
+	if ( opt.notify && sim_now >= host.next_notify_poll )
+	{
+		host.next_notify_poll = sim_now + notify_interval;
+		uint8_t report [8];
+		int n = sim_usb_tx1( report );
+		transaction_in( n );
+		if ( n == sizeof report )
+		{
+			host.notify_reports++;
+			host.notify_events |= report [0];
+			memcpy( host.notify, report, sizeof report );
+			if ( opt.verbose )
+				printf( "%10.3f ms  notify 0x%02X %3u %3u 0x%lX\n", sim_now / 1000,
+						report [0], report [1], report [2], report [4] |
+						report [5] << 8 | (unsigned long) report [6] << 16 );
+		}
+		else if ( n >= 0 )
+		{
+			sim_error( "Wrong notification size", n );
+		}
+		return;
+	}
+
+	if ( sim_now < host.ready )
+		return;
+
+	if ( opt.frame_limit )
+	{
+		long frame = (long) (sim_now / 1000);
+		if ( frame != host.frame )
+		{
+			host.frame = frame;
+			host.frame_transactions = 0;
+		}
+
+		if ( host.frame_transactions >= opt.frame_limit )
+		{
+			host.ready = (frame + 1) * 1000.0;
+			return;
+		}
+	}
+
+	// libusb gives up on transfer, as when device never finishes it
+	if ( host.phase != phase_idle && sim_now > host.start + transfer_timeout )
+	{
+		host.timeouts++;
+		finish_transfer();
+		return;
+	}
+
+	struct transfer_t* t = &transfers [host.cur];
+	int n;
+	switch ( host.phase )
+	{
+	case phase_idle:
+		host.start = sim_now;
+		if ( host.cur == 0 )
+			host.begin = host.prev_end = sim_now;
+		host.pos   = 0;
+		host.phase = phase_setup;
+		// fall through
+	case phase_setup: {
+		uint8_t setup [8] = {
+			(t->in ? 0xC0 : 0x40), t->request,
+			t->value, t->value >> 8,
+			t->index, t->index >> 8,
+			t->length, t->length >> 8
+		};
+		n = sim_usb_rx( 1, setup, 8 );
+		transaction_out( 8 );
+		if ( n )
+			host.phase = (t->length ? phase_data : phase_status);
+		break;
+	}
+
+	case phase_data:
+		if ( t->in )
+		{
+			n = sim_usb_tx( &host.in [host.pos] );
+			transaction_in( n );
+			if ( n == -2 )
+			{
+				host.stalls++;
+				finish_transfer();
+			}
+			else if ( n >= 0 )
+			{
+				host.pos += n;
+				if ( n < 8 || host.pos >= t->length )
+					host.phase = phase_status;
+			}
+		}
+		else
+		{
+			n = t->length - host.pos;
+			if ( n > 8 )
+				n = 8;
+			sim_usb_bad_crc = (opt.bad_crc && host.out_packets % opt.bad_crc == opt.bad_crc - 1);
+			int accepted = sim_usb_rx( 0, (t->data ? t->data + host.pos : host.in), n );
+			sim_usb_bad_crc = 0;
+			transaction_out( n );
+			if ( accepted )
+			{
+				host.out_packets++;
+				host.pos += n;
+				if ( host.pos >= t->length )
+					host.phase = phase_status;
+			}
+		}
+		break;
+
+	case phase_status:
+		if ( t->in )
+		{
+			n = sim_usb_rx( 0, NULL, 0 );
+			transaction_out( 0 );
+			if ( n )
+				finish_transfer();
+		}
+		else
+		{
+			uint8_t unused [8];
+			n = sim_usb_tx( unused );
+			transaction_in( n );
+			if ( n == -2 )
+			{
+				host.stalls++;
+				finish_transfer();
+			}
+			else if ( n > 0 )
+			{
+				sim_error( "Data sent in status stage", t->request );
+			}
+			else if ( n == 0 )
+			{
+				finish_transfer();
+			}
+		}
+		break;
+	}
+}
+
+
+// **** Report
+
+static unsigned long compare( const uint8_t* mem, const uint8_t* expected, long size )
+{
+	unsigned long diff = 0;
+	long i;
+	for ( i = 0; i < size; i++ )
+		if ( mem [i] != expected [i] )
+			diff++;
+	return diff;
+}
+
+static void report( int exited )
+{
+	const struct sim_stats_t* s = &sim_stats;
+	double session = host.end - host.begin;
+	int failed = 0;
+
+	printf( "atmega%d at %.1f MHz, %d-byte pages\n", SIM_DEVICE_NUM,
+			F_CPU / 1e6, SPM_PAGESIZE );
+
+	printf( "Transfers:     %lu, %lu bytes (%.1f bytes/transfer)\n",
+			(unsigned long) transfer_count, host.payload,
+			transfer_count ? (double) host.payload / transfer_count : 0.0 );
+
+	printf( "Startup:       %9.1f ms\n", s->startup / 1000 );
+	if ( host.phase == phase_done )
+		printf( "Session:       %9.1f ms\n", session / 1000 );
+	else
+		printf( "Session:       incomplete (%lu of %lu transfers)\n",
+				(unsigned long) host.cur, (unsigned long) transfer_count );
+	printf( "  flash write  %9.1f ms\n", host.phase_time [0] / 1000 );
+	printf( "  EEPROM write %9.1f ms\n", host.phase_time [1] / 1000 );
+	printf( "  read         %9.1f ms\n", host.phase_time [2] / 1000 );
+	printf( "  other        %9.1f ms\n", host.phase_time [3] / 1000 );
+	printf( "  SPM wait     %9.1f ms\n", s->spm_wait / 1000 );
+	printf( "  EEPROM wait  %9.1f ms\n", s->eeprom_wait / 1000 );
+	if ( exited && host.phase == phase_done )
+		printf( "Exit:          %9.1f ms after session\n", (sim_now - host.end) / 1000 );
+	else if ( !exited )
+		printf( "Exit:          bootloader still running\n" );
+
+	if ( host.flash_written && host.phase_time [0] > 0 )
+	{
+		double pages = (double) host.flash_written / SPM_PAGESIZE;
+		printf( "Flash upload:  %.0f pages, %.1f pages/s, %.2f KB/s\n", pages,
+				pages * 1e6 / host.phase_time [0],
+				host.flash_written * 1e6 / 1024 / host.phase_time [0] );
+	}
+
+	if ( packed_size )
+		printf( "Packed:        %lu flash bytes sent as %ld (%.0f%%)\n", host.flash_written,
+				packed_size, 100.0 * packed_size / host.flash_written );
+
+	unsigned long spm_ops = s->page_fills + s->page_erases + s->page_writes + s->rww_enables;
+	printf( "SPM:           %lu fill, %lu erase, %lu write, %lu RWW enable",
+			s->page_fills, s->page_erases, s->page_writes, s->rww_enables );
+	if ( s->page_writes )
+		printf( " (%.1f per page written)", (double) spm_ops / s->page_writes );
+	printf( "\n" );
+
+	printf( "EEPROM:        %lu erase+write, %lu erase, %lu write, %lu read\n",
+			s->eeprom_erase_writes, s->eeprom_erases, s->eeprom_writes,
+			s->eeprom_reads );
+
+	printf( "Device CRC:    %lu bytes\n", s->crc_bytes );
+
+	if ( profile_read )
+	{
+		static const char* const names [profile_ticks] =
+				{ "total", "usbPoll", "write", "read", "SPM wait", "EEPROM wait" };
+		printf( "Profile:       %u transfers, %u pages\n",
+				profile [24] | profile [25] << 8, profile [26] | profile [27] << 8 );
+		int i;
+		for ( i = 0; i < profile_ticks; i++ )
+		{
+			const uint8_t* p = &profile [i * 4];
+			unsigned long ticks = p [0] | p [1] << 8 | p [2] << 16 | (unsigned long) p [3] << 24;
+			printf( "  %-12s %9.1f ms\n", names [i], ticks * 64 * 1e3 / F_CPU );
+		}
+	}
+
+	if ( opt.notify )
+		printf( "Notify:        %lu reports, events 0x%02X, %u pages, %u erased (mod 256)\n",
+				host.notify_reports, host.notify_events, host.notify [1], host.notify [2] );
+
+	if ( host.mismatches || host.stalls || host.timeouts )
+	{
+		printf( "Host:          %lu bytes read back differ, %lu transfers stalled, "
+				"%lu timed out\n", host.mismatches, host.stalls, host.timeouts );
+		failed = 1;
+	}
+
+	if ( image )
+	{
+		unsigned long diff = compare( sim_flash, image, image_size );
+		if ( eeprom_image )
+			diff += compare( sim_eeprom, eeprom_image, eeprom_size );
+		printf( "Final memory:  %s\n", diff ? "DIFFERS from image" : "matches image" );
+		if ( diff )
+			failed = 1;
+	}
+
+	if ( s->errors )
+	{
+		printf( "Errors:        %lu\n", s->errors );
+		failed = 1;
+	}
+
+	if ( host.phase != phase_done )
+		failed = 1;
+
+	fflush( stdout );
+	if ( failed )
+		exit( EXIT_FAILURE );
+}
+
+void sim_host_exit( void )
+{
+	report( 1 );
+	exit( EXIT_SUCCESS );
+}
+
+
+// **** Main
+
+static uint8_t* load_file( const char* path, long* size, long max )
+{
+	FILE* f = fopen( path, "rb" );
+	if ( !f )
+	{
+		perror( path );
+		exit( EXIT_FAILURE );
+	}
+
+	uint8_t* p = malloc( max + 1 );
+	*size = fread( p, 1, max, f );
+	fclose( f );
+	return p;
+}
+
+static uint8_t* random_image( long size )
+{
+	uint8_t* p = malloc( size + 1 );
+	uint32_t r = 12345;
+	long i;
+	for ( i = 0; i < size; i++ )
+	{
+		r = r * 1103515245 + 12345;
+		p [i] = r >> 16;
+	}
+	return p;
+}
+
+// Program-like image: code, padding, and tables with repeated entries
+static uint8_t* program_image( long size )
+{
+	uint8_t* p = random_image( size );
+	uint32_t r = 1;
+	long i = 0;
+	while ( i < size )
+	{
+		r = r * 1103515245 + 12345;
+		long len = 64 + (r >> 20 & 0x1FF);
+		if ( len > size - i )
+			len = size - i;
+
+		int kind = r >> 16 & 3;
+		if ( kind == 0 )
+		{
+			memset( p + i, (r >> 8 & 1 ? 0xFF : 0x00), len );
+		}
+		else if ( kind == 1 && i >= 16 )
+		{
+			long j;
+			for ( j = 0; j < len; j++ )
+				p [i + j] = p [i + j - 16] + (j % 16 == 0);
+		}
+		i += len;
+	}
+	return p;
+}
+
+static void preload_changed( uint8_t* mem, uint8_t* img, long size, int page_size,
+		int percent )
+{
+	if ( !img )
+		return;
+
+	memcpy( mem, img, size );
+	long pages = (size + page_size - 1) / page_size;
+	long i;
+	for ( i = 0; i < pages; i++ )
+		if ( i * percent / 100 != (i + 1) * percent / 100 )
+			img [i * page_size] ^= 0x55;
+}
+
+static void usage( void )
+{
+	fprintf( stderr,
+		"Usage: sim [options] [session-file]\n"
+		"Runs bootloader against emulated host, replaying session-file or generating\n"
+		"an avrdude-style session from an image.\n"
+		"  -g FILE  generate session writing raw binary FILE to flash\n"
+		"  -r SIZE  generate session writing SIZE bytes of random data to flash\n"
+		"  -c SIZE  same, but with program-like data that compresses\n"
+		"  -e FILE  also write raw binary FILE to EEPROM\n"
+		"  -D       don't chip erase first (avrdude -D)\n"
+		"  -V       don't verify (avrdude -V)\n"
+		"  -b SIZE  bytes per paged transfer (default 200, as avrdude uses)\n"
+		"  -z       write flash with packed data request\n"
+		"  -s       write flash with stream request\n"
+		"  -E       erase blank flash pages with range erase request rather than\n"
+		"           sending them\n"
+		"  -x N     give every Nth OUT data packet a bad CRC\n"
+		"  -n       poll interrupt-in endpoint for notifications\n"
+		"  -P       read and show device's profile at end of session\n"
+		"  -C       verify with on-device CRC requests rather than reading back\n"
+		"  -p FILE  preload flash with raw binary FILE\n"
+		"  -u PCT   preload flash/EEPROM with image, then change PCT%% of its pages\n"
+		"  -w FILE  write session to FILE\n"
+		"  -T US    host delay between transfers (default 1000)\n"
+		"  -t N     limit to N transactions per 1 ms frame\n"
+		"  -v       list each transfer\n" );
+	exit( EXIT_FAILURE );
+}
+
+int main( int argc, char** argv )
+{
+	int erase = 1;
+	int verify = 1;
+	int changed = -1;
+	const char* session_out = NULL;
+
+	memset( sim_flash,  0xFF, FLASHEND + 1 );
+	memset( sim_eeprom, 0xFF, E2END + 1 );
+
+	int c;
+	while ( (c = getopt( argc, argv, "g:r:c:e:DVb:zsECnPp:u:w:T:t:x:v" )) != -1 )
+	{
+		switch ( c )
+		{
+		case 'g': image = load_file( optarg, &image_size, BOOTLOADER_ADDRESS ); break;
+		case 'r':
+		case 'c':
+			image_size = strtol( optarg, NULL, 0 );
+			if ( image_size > BOOTLOADER_ADDRESS )
+				image_size = BOOTLOADER_ADDRESS;
+			image = (c == 'r' ? random_image( image_size ) : program_image( image_size ));
+			break;
+		case 'e': eeprom_image = load_file( optarg, &eeprom_size, E2END + 1 ); break;
+		case 'D': erase = 0; break;
+		case 'V': verify = 0; break;
+		case 'z': opt.packed = 1; break;
+		case 's': opt.stream = 1; break;
+		case 'E': opt.erase_blank = 1; break;
+		case 'C': opt.crc_verify = 1; break;
+		case 'n': opt.notify = 1; break;
+		case 'P': opt.profile = 1; break;
+		case 'x': opt.bad_crc = atoi( optarg ); break;
+		case 'b':
+			opt.block = atoi( optarg );
+			if ( opt.block < 2 || opt.block > 16384 )
+				usage();
+			break;
+		case 'p': {
+			long size;
+			uint8_t* p = load_file( optarg, &size, BOOTLOADER_ADDRESS );
+			memcpy( sim_flash, p, size );
+			free( p );
+			break;
+		}
+		case 'u': changed = atoi( optarg ); break;
+		case 'w': session_out = optarg; break;
+		case 'T': opt.transfer_gap = strtod( optarg, NULL ); break;
+		case 't': opt.frame_limit = atoi( optarg ); break;
+		case 'v': opt.verbose = 1; break;
+		default: usage();
+		}
+	}
+
+	if ( image || eeprom_image )
+	{
+		if ( optind < argc )
+			usage();
+
+		if ( changed >= 0 )
+		{
+			// Installed program and data are image with some pages different
+			preload_changed( sim_flash, image, image_size, SPM_PAGESIZE, changed );
+			preload_changed( sim_eeprom, eeprom_image, eeprom_size, eeprom_page, changed );
+		}
+
+		generate_session( erase, verify );
+	}
+	else if ( optind + 1 == argc )
+	{
+		read_session( argv [optind] );
+	}
+	else
+	{
+		usage();
+	}
+
+	if ( session_out )
+		write_session( session_out );
+
+	if ( !transfer_count )
+		usage();
+
+	sim_run();
+}
@@ -0,0 +1,182 @@
+// Builds bootloader natively for host-side emulator, along with emulation
+// of the parts of usbdrvasm.S it relies on (interrupt handler and CRC).
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+
+#include "sim.h"
+
+#define USE_GLOBAL_REGS   0 // can't reserve registers on host
+#define HAVE_SELF_UPDATE  0 // do_spm is AVR assembly
+#define HAVE_FAST_ENTRY   0 // relies on AVR startup code's .init3 section
+#define HAVE_USB_HANDOFF  0 // jumps to program with IJMP
+#define HAVE_PAGE_SERVICE 0 // vector jumps to it in AVR assembly
+#define HAVE_USB_UPDATE   0 // installer is AVR assembly
+
+// LED_EXIT() is the first thing leaveBootloader() does
+#define LED_PRESENT 1
+#define LED_INIT()
+#define LED_BLINK()
+#define LED_EXIT()  sim_leave()
+
+// Same preamble as main.c, so that configuration is complete before usbdrv.h
+// is included below
+#ifndef MCUCSR
+	#define MCUCSR MCUSR
+#endif
+
+static void leaveBootloader( void ) __attribute__((noreturn));
+
+#include "usbconfig.h"
+#include "postconfig.h"
+
+// usbdrv assumes 16-bit int and pointers. Including it first here with
+// fixed-size types means main.c's include of it does nothing.
+#undef  usbMsgPtr_t
+#define usbMsgPtr_t uintptr_t
+#define uchar       uint8_t
+#define schar       int8_t
+#define unsigned    uint16_t
+#include "usbdrv/usbdrv.h"
+#undef  unsigned
+
+#if USB_CFG_LONG_TRANSFERS
+	#undef  usbMsgLen_t
+	#define usbMsgLen_t uint16_t
+#endif
+
+// Referenced by usbdrv.c code that's never reached with this configuration
+USB_PUBLIC usbMsgLen_t usbFunctionDescriptor( struct usbRequest* rq ) { return 0; }
+
+#undef  usbCrc16
+#define usbCrc16( data, len )       sim_crc16( (const uint8_t*) (data), len )
+#undef  usbCrc16Append
+#define usbCrc16Append( data, len ) sim_crc16_append( (uint8_t*) (data), len )
+
+#define main bootloader_main
+#include "main.c"
+#undef main
+
+void sim_run( void )
+{
+	USBIN = USBIDLE;
+	bootloader_main();
+}
+
+void sim_main_loop( void )
+{
+	if ( !sim_stats.startup )
+		sim_stats.startup = sim_now;
+
+	sim_cycles( main_loop_clk );
+	sim_host_poll();
+}
+
+void sim_leave( void )
+{
+	sim_host_exit();
+}
+
+
+// **** usbdrvasm.S
+
+static uint16_t crc16( const uint8_t* data, uint8_t len )
+{
+	uint16_t crc = 0xFFFF;
+	while ( len-- )
+	{
+		crc ^= *data++;
+		int n;
+		for ( n = 8; n; n-- )
+			crc = (crc & 1 ? crc >> 1 ^ 0xA001 : crc >> 1);
+	}
+	return ~crc;
+}
+
+static void crc16_append( uint8_t* data, uint8_t len )
+{
+	uint16_t crc = crc16( data, len );
+	data [len    ] = crc;
+	data [len + 1] = crc >> 8;
+}
+
+uint16_t sim_crc16( const uint8_t* data, uint8_t len )
+{
+	sim_stats.crc_bytes += len;
+	sim_cycles( len * (USB_USE_FAST_CRC ? 31 : 65) );
+	return crc16( data, len );
+}
+
+uint16_t sim_crc16_append( uint8_t* data, uint8_t len )
+{
+	uint16_t crc = sim_crc16( data, len );
+	crc16_append( data, len );
+	return crc;
+}
+
+// Same decisions as handleData/handleIn in asmcommon.inc
+
+int sim_usb_bad_crc;
+
+int sim_usb_rx( int setup, const uint8_t* data, uint8_t len )
+{
+	if ( usbRxLen != 0 )
+		return 0; // NAK: previous packet not processed, or flow control
+
+	if ( !setup && len == 0 )
+		return 1; // zero-sized status packet: ACK and ignore
+
+	uchar* buf = usbRxBuf + usbInputBufOffset;
+	buf [0] = USBPID_DATA0;
+	memcpy( buf + 1, data, len );
+	crc16_append( buf + 1, len );
+	if ( sim_usb_bad_crc )
+		buf [len + 1] ^= 0x01;
+
+	usbRxToken = (setup ? USBPID_SETUP : USBPID_OUT);
+	usbRxLen   = len + 3;
+	usbInputBufOffset = USB_BUFSIZE - usbInputBufOffset;
+	return 1;
+}
+
+int sim_usb_tx( uint8_t* data )
+{
+	if ( usbRxLen > 0 )
+		return -1; // unprocessed input
+
+	uchar len = usbTxLen;
+	if ( len & 0x10 )
+		return (len == USBPID_STALL ? -2 : -1);
+
+	usbTxLen = USBPID_NAK;
+	len -= 4; // PID, CRC and sync
+	if ( crc16( usbTxBuf + 1, len + 2 ) != 0x4FFE )
+		sim_error( "Bad CRC in IN packet", len );
+	memcpy( data, usbTxBuf + 1, len );
+	return len;
+}
+
+int sim_usb_tx1( uint8_t* data )
+{
+#if USB_CFG_HAVE_INTRIN_ENDPOINT
+	uchar len = usbTxLen1;
+	if ( len & 0x10 )
+		return -1;
+
+	usbTxLen1 = USBPID_NAK;
+	len -= 4;
+	if ( crc16( usbTxBuf1 + 1, len + 2 ) != 0x4FFE )
+		sim_error( "Bad CRC in interrupt-in packet", len );
+	memcpy( data, usbTxBuf1 + 1, len );
+	return len;
+#else
+	return -1;
+#endif
+}
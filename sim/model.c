@@ -0,0 +1,297 @@
+// Flash, EEPROM and time model for host-side emulator. Charges datasheet
+// timings for SPM and EEPROM operations and flags operations the hardware
+// wouldn't perform.
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+
+#include "sim.h"
+
+// Datasheet maximum programming times, in microseconds
+enum { flash_write_us  = 4500 }; // page erase or page write
+#if SIM_HAVE_EEPM
+	enum { eeprom_erase_write_us = 3400, eeprom_split_us = 1800 };
+#else
+	enum { eeprom_erase_write_us = 8500, eeprom_split_us = 8500 };
+#endif
+
+double sim_now;
+struct sim_stats_t sim_stats;
+
+uint8_t sim_flash  [FLASHEND + 1];
+uint8_t sim_eeprom [E2END + 1];
+uint8_t sim_fuses  [4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+volatile uint8_t sim_io [0x100];
+
+void sim_error( const char* msg, unsigned long addr )
+{
+	if ( sim_stats.errors++ < 10 )
+		fprintf( stderr, "Error at %.3f ms: %s (address 0x%lX)\n",
+				sim_now / 1000, msg, addr );
+}
+
+volatile uint16_t* sim_timer1( void )
+{
+	static const int prescale [8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	static uint16_t tcnt;
+
+	sim_cycles( 1 );
+	int n = prescale [TCCR1B & 7];
+	if ( n )
+		tcnt = (uint16_t) (unsigned long) (sim_now * (F_CPU / 1e6) / n);
+	return &tcnt;
+}
+
+
+// **** SPM
+
+static uint16_t page_buf    [SPM_PAGESIZE / 2];
+static uint8_t  page_loaded [SPM_PAGESIZE / 2];
+static double   spm_done;
+static uint8_t  rww_busy;
+
+static double   eeprom_done;
+static uint8_t  eeprom_busy;
+
+static void clear_page_buf( void )
+{
+	memset( page_loaded, 0, sizeof page_loaded );
+}
+
+static void eeprom_sync( void );
+
+static void advance_to( double t )
+{
+	eeprom_sync();
+	if ( sim_now < t )
+		sim_now = t;
+	eeprom_sync();
+}
+
+void sim_cycles( unsigned long clocks )
+{
+	advance_to( sim_now + clocks * (1e6 / F_CPU) );
+}
+
+void sim_delay_us( double us )
+{
+	advance_to( sim_now + us );
+}
+
+uint8_t sim_spm_busy( void )
+{
+	sim_cycles( 2 );
+	return sim_now < spm_done;
+}
+
+uint8_t sim_rww_busy( void )
+{
+	sim_cycles( 1 );
+	return rww_busy;
+}
+
+void sim_spm_busy_wait( void )
+{
+	if ( sim_now < spm_done )
+	{
+		sim_stats.spm_wait += spm_done - sim_now;
+		advance_to( spm_done );
+	}
+}
+
+void sim_spm( int op, uint32_t addr, uint16_t data )
+{
+	sim_cycles( 6 ); // includes CLI/SEI around it
+
+	if ( sim_now < spm_done )
+	{
+		sim_error( "SPM while previous SPM busy", addr );
+		return;
+	}
+
+	if ( eeprom_busy )
+	{
+		sim_error( "SPM while EEPROM write busy", addr );
+		return;
+	}
+
+	uint32_t page = addr & ~(uint32_t) (SPM_PAGESIZE - 1);
+	if ( (op == sim_spm_erase || op == sim_spm_write) && page >= BOOTLOADER_ADDRESS )
+	{
+		sim_error( "SPM to bootloader section", addr );
+		return;
+	}
+
+	int i;
+	switch ( op )
+	{
+	case sim_spm_fill:
+		sim_stats.page_fills++;
+		i = (addr & (SPM_PAGESIZE - 1)) / 2;
+		if ( page_loaded [i] )
+		{
+			sim_error( "Page buffer word loaded twice", addr );
+			break;
+		}
+		page_loaded [i] = 1;
+		page_buf [i] = data;
+		break;
+
+	case sim_spm_erase:
+		sim_stats.page_erases++;
+		memset( &sim_flash [page], 0xFF, SPM_PAGESIZE );
+		spm_done = sim_now + flash_write_us;
+		rww_busy = 1;
+		break;
+
+	case sim_spm_write:
+		sim_stats.page_writes++;
+		for ( i = 0; i < SPM_PAGESIZE / 2; i++ )
+		{
+			// Programming can only clear bits; words not loaded are 0xFFFF
+			uint16_t w = (page_loaded [i] ? page_buf [i] : 0xFFFF);
+			sim_flash [page + i*2    ] &= w;
+			sim_flash [page + i*2 + 1] &= w >> 8;
+		}
+		clear_page_buf();
+		spm_done = sim_now + flash_write_us;
+		rww_busy = 1;
+		break;
+
+	case sim_spm_rww:
+		sim_stats.rww_enables++;
+		clear_page_buf();
+		rww_busy = 0;
+		break;
+	}
+}
+
+uint8_t sim_pgm_read_byte( uint32_t addr )
+{
+	sim_cycles( 3 );
+
+	if ( addr > FLASHEND )
+	{
+		sim_error( "Flash read beyond end", addr );
+		return 0xFF;
+	}
+
+	if ( rww_busy && addr < SIM_NRWW_START )
+	{
+		sim_error( "Flash read from RWW section while busy", addr );
+		return 0xFF;
+	}
+
+	return sim_flash [addr];
+}
+
+
+// **** EEPROM
+
+static uint16_t eear;
+
+// Starts operation requested via EECR, and finishes one whose time is up.
+// Called on every register access and before time advances, so operations
+// start at the time the program requested them.
+static void eeprom_sync( void )
+{
+	uint8_t cr = SIM_EECR;
+
+	if ( eeprom_busy && sim_now >= eeprom_done )
+	{
+		eeprom_busy = 0;
+		cr &= ~(1<<EEPE);
+	}
+
+	if ( (cr & 1<<EEPE) && !eeprom_busy )
+	{
+		uint16_t addr = eear & E2END;
+		uint8_t old = sim_eeprom [addr];
+		uint8_t mode = 0;
+		#if SIM_HAVE_EEPM
+			mode = cr >> EEPM0 & 3;
+		#endif
+
+		if ( !(cr & 1<<EEMPE) )
+		{
+			sim_error( "EEPE set without EEMPE", addr );
+			cr &= ~(1<<EEPE);
+		}
+		else if ( sim_now < spm_done )
+		{
+			sim_error( "EEPROM write while SPM busy", addr );
+			cr &= ~(1<<EEPE);
+		}
+		else
+		{
+			double t = eeprom_split_us;
+			if ( mode == 0 )
+			{
+				sim_stats.eeprom_erase_writes++;
+				sim_eeprom [addr] = SIM_EEDR;
+				t = eeprom_erase_write_us;
+			}
+			else if ( mode == 1 )
+			{
+				sim_stats.eeprom_erases++;
+				sim_eeprom [addr] = 0xFF;
+			}
+			else if ( mode == 2 )
+			{
+				sim_stats.eeprom_writes++;
+				sim_eeprom [addr] = old & SIM_EEDR;
+			}
+			else
+			{
+				sim_error( "Reserved EEPROM programming mode", addr );
+			}
+
+			// Loaded page buffer is lost if EEPROM is written
+			int i;
+			for ( i = 0; i < SPM_PAGESIZE / 2; i++ )
+				if ( page_loaded [i] )
+					sim_error( "EEPROM write during page buffer load", addr );
+			clear_page_buf();
+
+			eeprom_busy = 1;
+			eeprom_done = sim_now + t;
+			cr &= ~(1<<EEMPE);
+		}
+	}
+
+	if ( cr & 1<<EERE )
+	{
+		cr &= ~(1<<EERE);
+		if ( eeprom_busy )
+		{
+			sim_error( "EEPROM read while write busy", eear );
+		}
+		else
+		{
+			sim_stats.eeprom_reads++;
+			SIM_EEDR = sim_eeprom [eear & E2END];
+			sim_now += 4 * (1e6 / F_CPU); // CPU halted during read
+		}
+	}
+
+	SIM_EECR = cr;
+}
+
+volatile uint8_t* sim_ee_reg( volatile uint8_t* reg )
+{
+	sim_cycles( 1 );
+	if ( eeprom_busy && reg == &SIM_EECR )
+	{
+		// Any access while busy is treated as a wait, since that's the only
+		// reason to poll EECR
+		sim_stats.eeprom_wait += 1e6 / F_CPU;
+	}
+	return reg;
+}
+
+volatile uint16_t* sim_ee_addr( void )
+{
+	sim_cycles( 1 );
+	return &eear;
+}
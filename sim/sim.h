@@ -0,0 +1,81 @@
+// Host-side emulator for running the bootloader natively on a PC. The mock
+// AVR headers in this directory route flash, EEPROM and timing operations
+// here, where they're counted and charged datasheet timings.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// Modeled time, in microseconds since reset
+extern double sim_now;
+
+// Counters reported at end of run
+struct sim_stats_t {
+	unsigned long page_fills;
+	unsigned long page_erases;
+	unsigned long page_writes;
+	unsigned long rww_enables;
+	unsigned long eeprom_reads;
+	unsigned long eeprom_erase_writes; // atomic erase+write
+	unsigned long eeprom_erases;       // erase-only
+	unsigned long eeprom_writes;       // write-only
+	unsigned long crc_bytes;
+	unsigned long errors;              // misuse of SPM/EEPROM hardware
+	double spm_wait;                   // time spent in boot_spm_busy_wait()
+	double eeprom_wait;                // time spent waiting for EEPROM
+	double startup;                    // reset until main loop first runs
+};
+extern struct sim_stats_t sim_stats;
+
+extern uint8_t sim_flash  [];
+extern uint8_t sim_eeprom [];
+extern uint8_t sim_fuses  [4];
+extern volatile uint8_t sim_io [0x100];
+
+// Time
+void sim_cycles( unsigned long clocks );
+void sim_delay_us( double us );
+
+// Timer1 count register
+volatile uint16_t* sim_timer1( void );
+
+// Reports misuse of emulated hardware
+void sim_error( const char* msg, unsigned long addr );
+
+// SPM
+enum { sim_spm_fill, sim_spm_erase, sim_spm_write, sim_spm_rww };
+void    sim_spm( int op, uint32_t addr, uint16_t data );
+uint8_t sim_spm_busy( void );
+uint8_t sim_rww_busy( void );
+void    sim_spm_busy_wait( void );
+uint8_t sim_pgm_read_byte( uint32_t addr );
+
+// EEPROM control registers, synchronized with modeled EEPROM state on access
+volatile uint8_t*  sim_ee_reg( volatile uint8_t* reg );
+volatile uint16_t* sim_ee_addr( void );
+
+// USB CRC, normally in usbdrvasm.S
+uint16_t sim_crc16( const uint8_t* data, uint8_t len );
+uint16_t sim_crc16_append( uint8_t* data, uint8_t len );
+
+// Called from bootloader's main loop (via wdt_reset()) and when it exits
+void sim_main_loop( void );
+void sim_leave( void ) __attribute__((noreturn));
+
+// Host side, called by sim_main_loop()
+void sim_host_poll( void );
+void sim_host_exit( void ) __attribute__((noreturn));
+
+// Emulation of usbdrvasm's interrupt handler. sim_usb_rx() delivers a SETUP
+// or OUT data packet and returns 0 if device NAKs. sim_usb_tx() handles an
+// IN token and returns number of bytes sent, -1 for NAK, or -2 for STALL.
+// If sim_usb_bad_crc is set, sim_usb_rx() delivers packet with bad CRC.
+// sim_usb_tx1() is same as sim_usb_tx(), for interrupt-in endpoint 1.
+int  sim_usb_rx( int setup, const uint8_t* data, uint8_t len );
+int  sim_usb_tx( uint8_t* data );
+int  sim_usb_tx1( uint8_t* data );
+void sim_run( void ) __attribute__((noreturn));
+extern int sim_usb_bad_crc;
+
+#endif
@@ -0,0 +1,19 @@
+// Mock of avr-libc's <util/crc16.h>; charges cycles of its inline assembly
+
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+
+#include <stdint.h>
+#include "sim.h"
+
+static inline uint16_t _crc16_update( uint16_t crc, uint8_t a )
+{
+	sim_cycles( 15 );
+	crc ^= a;
+	int i;
+	for ( i = 0; i < 8; i++ )
+		crc = (crc & 1 ? crc >> 1 ^ 0xA001 : crc >> 1);
+	return crc;
+}
+
+#endif
@@ -22,18 +22,25 @@ static PROGMEM const uint8_t loader [] = {
 	#define PGM_READ_BYTE pgm_read_byte
 #endif
 
-// Second do_spm core to use when updating bulk of bootloader
+// Second do_spm core to use when updating bulk of bootloader. Its page mode
+// writes a whole page per call.
+#define HAVE_SPM_PAGE 1
 #include "do_spm.h"
 
-// Calls do_spm routine, loading Z with addr, r1:r0 with data, and writing cmd to SPMCR
+// Calls do_spm routine, loading Z with addr, r1:r0 and Y with data, and writing
+// cmd to SPMCR
 static __attribute((naked)) void call_do_spm( uint8_t cmd, uint16_t addr,
 		uint16_t data, addr_t do_spm )
 {
 	// Pushes do_spm on stack to call, rather than using EICALL, so that Z can be used
 	// for address passed to routine.
 	asm volatile (
+	"\n		push r28"		// Y is source for page mode
+	"\n		push r29"
 	"\n		rcall 1f"		// need to clear r1 after do_spm
 	"\n		clr r1"
+	"\n		pop r29"
+	"\n		pop r28"
 	#ifdef RAMPZ
 	"\n		sts %[rampz], r1"
 	#endif
@@ -50,6 +57,7 @@ static __attribute((naked)) void call_do_spm( uint8_t cmd, uint16_t addr,
 	#endif
 	"\n		movw r30, r22"	// Z=addr
 	"\n		movw r0, r20"	// r1:r0=data
+	"\n		movw r28, r20"	// Y=data
 	"\n		ldi r26, lo8(%[spmcr])"	// X=spmcr
 	"\n		ldi r27, hi8(%[spmcr])"
 	"\n		ret"			// Call do_spm
@@ -61,9 +69,18 @@ static __attribute((naked)) void call_do_spm( uint8_t cmd, uint16_t addr,
 	);
 }
 
-// Copy page from in to addr in flash
-static void copy_page( addr_t addr, const uint8_t in [], const uint8_t* in_end, addr_t do_spm )
+// Copy page from in to addr in flash. page_mode if do_spm is our own copy,
+// since bootloader's might not have it.
+static void copy_page( addr_t addr, const uint8_t in [], const uint8_t* in_end,
+		addr_t do_spm, bool page_mode )
 {
+	// Whole page in one call, unless last one needs padding
+	if ( DO_SPM_PAGE_MODE && page_mode && in_end - in >= SPM_PAGESIZE )
+	{
+		call_do_spm( DO_SPM_PAGE_FLASH, addr, (unsigned) in, do_spm );
+		return;
+	}
+	
 	// Erase flash page
 	call_do_spm( 1<<PGERS | 1<<SPMEN, addr, 0, do_spm );
 	
@@ -87,11 +104,30 @@ static void copy_page( addr_t addr, const uint8_t in [], const uint8_t* in_end,
 	call_do_spm( 1<<PGWRT | 1<<SPMEN, addr - 2, 0, do_spm );
 }
 
+// True if flash page at addr differs from loader page at in, padded with 0xff
+// as copy_page() does
+static bool page_differs( addr_t addr, const uint8_t* in )
+{
+	int n;
+	for ( n = SPM_PAGESIZE; n; n-- )
+	{
+		uint8_t data = 0xff;
+		if ( in < loader_end )
+			data = PGM_READ_BYTE( in );
+		
+		if ( PGM_READ_BYTE( addr ) != data )
+			return true;
+		in++;
+		addr++;
+	}
+	return false;
+}
+
 // Only way to get SPM_RDY_vect vector number below
 #undef _VECTOR
 #define _VECTOR(n) n
 
-// Updates bootloader
+// Updates bootloader, rewriting only pages that differ
 static void update_loader( void )
 {
 	// Addresses
@@ -102,36 +138,56 @@ static void update_loader( void )
 	
 	const uint8_t* const do_spm2_in = (uint8_t*) ((unsigned) do_spm*2);
 	
-	// Put do_spm2 at top of flash
-	copy_page( do_spm2_addr, do_spm2_in, do_spm2_in + SPM_PAGESIZE, do_spm1 );
+	// do_spm1 is the vector at the first page, but the routine it jumps to
+	// is somewhere in .text, and rewriting either one while using it would
+	// brick the part. So if any page below the last differs, do_spm2 is
+	// put at top of flash and used for all of them.
+	bool use_do_spm2 = false;
+	{
+		addr_t addr = BOOTLOADER_ADDRESS;
+		const uint8_t* in;
+		for ( in = loader; in < loader_end && addr < do_spm2_addr; in += SPM_PAGESIZE )
+		{
+			if ( page_differs( addr, in ) )
+				use_do_spm2 = true;
+			addr += SPM_PAGESIZE;
+		}
+	}
+	
+	if ( use_do_spm2 )
+		copy_page( do_spm2_addr, do_spm2_in, do_spm2_in + SPM_PAGESIZE, do_spm1, false );
 	
-	// Copy pages, using do_spm2 for all except last (if the loader is even that big)
+	// Copy changed pages, using do_spm2 (if written) for all except last (if
+	// the loader is even that big). do_spm2 overwrote last page, so it must
+	// be restored as well.
 	addr_t addr = BOOTLOADER_ADDRESS;
 	const uint8_t* in;
 	for ( in = loader; in < loader_end; in += SPM_PAGESIZE )
 	{
-		copy_page( addr, in, loader_end, (addr < do_spm2_addr ? do_spm2 : do_spm1) );
+		if ( (use_do_spm2 && addr == do_spm2_addr) || page_differs( addr, in ) )
+		{
+			bool own = (use_do_spm2 && addr < do_spm2_addr);
+			copy_page( addr, in, loader_end, (own ? do_spm2 : do_spm1), own );
+		}
 		addr += SPM_PAGESIZE;
 	}
 }
 
-// True if loader[] matches current bootloader
+// True if loader[] doesn't match current bootloader
 static bool needs_update( void )
 {
-	// Prevent optimizer from assuming that is_updated() returns the same
+	// Prevent optimizer from assuming that needs_update() returns the same
 	// value every time it's called (it assumes pgm_read is pure)
 	static volatile addr_t bl_addr = BOOTLOADER_ADDRESS;
 	
-	const uint8_t* in = loader;
+	const uint8_t* in;
 	addr_t old = bl_addr;
-	do
+	for ( in = loader; in < loader_end; in += SPM_PAGESIZE )
 	{
-		if ( PGM_READ_BYTE( in ) != PGM_READ_BYTE( old ) )
+		if ( page_differs( old, in ) )
 			return true;
-		in++;
-		old++;
+		old += SPM_PAGESIZE;
 	}
-	while ( in < loader_end );
 	return false;
 }
 
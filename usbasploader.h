@@ -0,0 +1,139 @@
+// Services bootloader provides to user program. Include in program, with
+// BOOTLOADER_ADDRESS defined same as when bootloader was built.
+
+#ifndef USBASPLOADER_H
+#define USBASPLOADER_H
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifndef BOOTLOADER_ADDRESS
+	#error "BOOTLOADER_ADDRESS must be defined"
+#endif
+
+// Value program leaves in top two bytes of RAM before jumping to bootloader,
+// so it stays in USBasp mode regardless of its entry condition
+#define USBASPLOADER_MAGIC 0xB007
+
+// Runs bootloader immediately, without a watchdog reset and with a shorter
+// USB re-enumeration delay. Bootloader must have been built with
+// HAVE_FAST_ENTRY. Program must first disable any interrupts it enabled,
+// since bootloader's vectors don't handle them.
+static inline void usbasploaderEnter( void ) __attribute__((noreturn));
+static inline void usbasploaderEnter( void )
+{
+	cli();
+	*(volatile uint16_t*) (RAMEND - 1) = USBASPLOADER_MAGIC;
+
+	// Indirect call uses EIND for upper bits on devices with large flash
+	#ifdef EIND
+		EIND = (uint32_t) BOOTLOADER_ADDRESS >> 17;
+	#endif
+
+	((void (*)( void )) (uint16_t) (BOOTLOADER_ADDRESS / 2))();
+	for ( ;; ) { }
+}
+
+// Page programming service, reached through this vector in bootloader's
+// vector table (bootloader never enables its interrupt)
+#if defined (EE_READY_vect)
+	#define USBASPLOADER_SERVICE_vect EE_READY_vect
+#else
+	#define USBASPLOADER_SERVICE_vect EE_RDY_vect
+#endif
+
+#ifndef _VECTOR_SIZE
+	#define _VECTOR_SIZE (FLASHEND > 0x1FFF ? 4 : 2)
+#endif
+
+// Vector number, without redefining _VECTOR() for rest of program
+#pragma push_macro("_VECTOR")
+#undef  _VECTOR
+#define _VECTOR(n) n
+enum { usbasploader_service_vect_num = USBASPLOADER_SERVICE_vect };
+#pragma pop_macro("_VECTOR")
+
+enum {
+	usbasploader_ok            = 0,
+	usbasploader_refused       = 1, // page is in bootloader section
+	usbasploader_verify_failed = 2
+};
+
+// Programs SPM_PAGESIZE bytes of data into flash page containing addr:
+// erases if needed, writes, re-enables RWW section, then verifies. Leaves
+// page alone if it already has this data. Interrupts are disabled for up to
+// about 9 ms while page is programmed. Bootloader must have been built with
+// HAVE_PAGE_SERVICE. Returns usbasploader_ok on success.
+static inline uint8_t usbasploaderProgramPage( uint32_t addr, const void* data )
+{
+	typedef uint8_t (*service_t)( uint32_t, const void* );
+	const uint32_t vect = BOOTLOADER_ADDRESS +
+			(uint32_t) usbasploader_service_vect_num * _VECTOR_SIZE;
+
+	#ifdef EIND
+		EIND = vect >> 17;
+	#endif
+	uint8_t result = ((service_t) (uint16_t) (vect / 2))( addr, data );
+	#ifdef EIND
+		EIND = 0; // GCC assumes program's indirect calls don't need it
+	#endif
+	return result;
+}
+
+// Left at top of RAM by bootloader built with HAVE_USB_HANDOFF, when it runs
+// program after host has enumerated it. Program can then keep the USB
+// address and configuration rather than having host enumerate it again. Its
+// USB descriptors must be the same as bootloader's.
+struct usbasploaderHandoff {
+	uint8_t  deviceAddr;    // address host assigned
+	uint8_t  configuration;
+	uint8_t  dataToken1;    // last data token sent on endpoint 1, or 0 if none
+	uint16_t magic;         // USBASPLOADER_HANDOFF_MAGIC if valid
+};
+
+#define USBASPLOADER_HANDOFF_MAGIC 0xB00C
+
+#define USBASPLOADER_HANDOFF ((volatile struct usbasploaderHandoff*) \
+		(RAMEND + 1 - sizeof (struct usbasploaderHandoff)))
+
+// Copies handoff left by bootloader, and invalidates it. Stack overwrites it,
+// so this must be called from a naked function in .init3, for example:
+//
+//     static struct usbasploaderHandoff handoff __attribute__((section(".noinit")));
+//     static void getHandoff( void ) __attribute__((naked,used,section(".init3")));
+//     static void getHandoff( void ) { usbasploaderGetHandoff( &handoff ); }
+static inline void usbasploaderGetHandoff( struct usbasploaderHandoff* out )
+{
+	volatile struct usbasploaderHandoff* h = USBASPLOADER_HANDOFF;
+	out->deviceAddr    = h->deviceAddr;
+	out->configuration = h->configuration;
+	out->dataToken1    = h->dataToken1;
+	out->magic         = h->magic;
+	h->magic = 0;
+}
+
+#ifdef __usbdrv_h_included__
+	extern uchar usbDeviceAddr;
+	extern uchar usbNewDeviceAddr;
+	
+	// Restores usbdrv state from handoff. Call after usbInit(), and do the
+	// usual usbDeviceDisconnect(), delay and usbDeviceConnect() only if this
+	// returns 0 (no valid handoff).
+	static inline uint8_t usbasploaderResume( const struct usbasploaderHandoff* h )
+	{
+		if ( h->magic != USBASPLOADER_HANDOFF_MAGIC )
+			return 0;
+		
+		usbNewDeviceAddr = h->deviceAddr;
+		usbDeviceAddr    = h->deviceAddr << 1; // usbdrvasm compares shifted address
+		usbConfiguration = h->configuration;
+		#if USB_CFG_HAVE_INTRIN_ENDPOINT
+			if ( h->dataToken1 )
+				usbTxBuf1 [0] = h->dataToken1;
+		#endif
+		return 1;
+	}
+#endif
+
+#endif
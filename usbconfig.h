@@ -24,15 +24,20 @@
 
 #define USB_CFG_CLOCK_KHZ       (F_CPU/1000)
 
-// Check CRC of all received data. We have plenty of time.
+// Check CRC of all received data. We have plenty of time. With
+// HAVE_WRITE_CRC, main.c checks data packets itself as it uses them.
 #define USB_RX_USER_HOOK( data, len ) { \
-	if ( usbCrc16( data, len + 2 ) != 0x4FFE )\
+	if ( (!HAVE_WRITE_CRC || usbRxToken == (uchar) USBPID_SETUP) &&\
+			usbCrc16( data, len + 2 ) != 0x4FFE )\
 		return;\
 }
 
 /* --------------------------- Functional Range ---------------------------- */
 
-#define USB_CFG_HAVE_INTRIN_ENDPOINT    0
+#ifndef HAVE_NOTIFY // can be set in bootloaderconfig.h
+#define HAVE_NOTIFY                     0
+#endif
+#define USB_CFG_HAVE_INTRIN_ENDPOINT    HAVE_NOTIFY
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
@@ -102,7 +107,7 @@
  * interrupt/bulk data sent to any endpoint other than 0. The endpoint number
  * can be found in 'usbRxToken'.
  */
-#define USB_CFG_HAVE_FLOWCONTROL        0
+#define USB_CFG_HAVE_FLOWCONTROL        HAVE_PIPELINED_WRITE // set in postconfig.h
 /* Define this to 1 if you want flowcontrol over USB data. See the definition
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
@@ -112,7 +117,7 @@
  * where the driver's constants (descriptors) are located. Or in other words:
  * Define this to 1 for boot loaders on the ATMega128.
  */
-#define USB_CFG_LONG_TRANSFERS          0
+#define USB_CFG_LONG_TRANSFERS          HAVE_LONG_TRANSFERS // set in postconfig.h
 /* Define this to 1 if you want to send/receive blocks of more than 254 bytes
  * in a single control-in or control-out transfer. Note that the capability
  * for long transfers increases the driver size.
@@ -169,7 +174,9 @@
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
  */
+#ifndef USB_USE_FAST_CRC // can be set in bootloaderconfig.h
 #define USB_USE_FAST_CRC                0
+#endif
 /* The assembler module has two implementations for the CRC algorithm. One is
  * faster, the other is smaller. This CRC routine is only used for transmitted
  * messages where timing is not critical. The faster routine needs 31 cycles